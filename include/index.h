@@ -242,6 +242,9 @@ typedef int (*index_cmp)(const void *, const void *, void *);
 @end
 
 typedef void (*ixsort_on_duplicate)(void* arg, struct index_node* a, struct index_node* b, uint32_t position);
+/* if > 1, -sort_nodes: of large arrays (e.g. index build after snapshot load)
+   is done by that many threads: comparator must be thread safe */
+extern int index_sort_threads;
 @interface Tree: Index <BasicIndex, IterIndex>
 - (void)set_sorted_nodes:(void *)nodes_ count:(size_t)count;
 - (bool)sort_nodes:(void *)nodes_ count:(size_t)count onduplicate:(ixsort_on_duplicate)ondup arg:(void*)arg;
@@ -59,10 +59,16 @@ enum row_tag {
 	shard_alter,
 	shard_final,
 	tlv,
+	snap_part,
+	snap_ref,
 
 	user_tag = 32
 };
 
+/* snap_initial flags */
+#define SNAP_F_PARTS 1 /* manifest: shards are in <lsn>.snap.partNNN files
+			  listed by snap_part rows */
+
 
 /* two highest bit in tag encode tag type:
    00 - invalid
@@ -143,25 +149,54 @@ typedef void (follow_cb)(ev_stat *w, int events);
 	const char *filetype;
 	const char *suffix;
 	const char *dirname;
+
+	FILE *spare; /* pre-created file for the next open_for_write */
+	char *spare_vbuf;
+	off_t spare_alloced;
 };
 - (id) init_dirname:(const char *)dirname_;
 - (XLog *) open_for_read:(i64)lsn;
 - (XLog *) open_for_write:(i64)lsn scn:(const i64 *)shard_scn_map;
+- (XLog *) open_for_read:(i64)lsn part:(int)part;
+- (XLog *) open_for_write:(i64)lsn scn:(const i64 *)shard_scn_map part:(int)part;
+- (int) prepare_spare;
+- (bool) has_spare;
 - (XLog *) find_with_lsn:(i64)lsn;
+- (void) readahead:(int)count after:(i64)file_lsn done:(i64 *)done_lsn;
 - (XLog *) find_with_scn:(i64)scn shard:(int)shard_id;
+- (i64) find_with_scn_map:(const i64 *)scn;
+- (int) scn_map:(i64 *)scn lsn:(i64)lsn part:(int)part;
+/* unlink files (and their seek indexes) with LSN < lsn, returns count removed */
+- (int) remove_older:(i64)lsn;
 - (i64) greatest_lsn;
+- (i64) least_lsn;
 - (int) lock;
 - (int) stat:(struct stat *)buf;
 - (int) sync;
 @end
 
+struct snap_ref;
+
 @interface SnapDir: XLogDir
+- (bool) has_snap:(i64)lsn part:(int)part;
+- (struct snap_ref *) load_refs:(i64)lsn count:(u32 *)count;
+- (int) store_refs:(const struct snap_ref *)ref count:(u32)count lsn:(i64)lsn;
+/* -remove_older: keeps snapshots referred to by newer ones */
+- (int) remove_all_but:(int)keep;
 @end
 
 @interface WALDir: XLogDir
 @end
 
 extern XLogDir *wal_dir, *snap_dir;
+
+/* WAL streams: each stream has its own directory, WAL writer and LSN.
+   Stream 0 is wal_dir, its LSN is the LSN of snapshots.
+   Rows of shard go to stream shard_id % wal_streams */
+#define WAL_STREAM_MAX 16
+extern XLogDir *wal_stream_dir[WAL_STREAM_MAX];
+extern int wal_streams;
+static inline int wal_stream(int shard_id) { return shard_id % wal_streams; }
 struct _row_v04 {
 	i64 lsn;
 	u16 type;
@@ -212,6 +247,8 @@ typedef struct marker_desc {
 
 	FILE *fd;
 	i64 last_read_lsn;
+	off_t last_read_offset; /* offset of marker of last read row (or its block) */
+	struct xlog_index *index;
 @public
 	char *filename;
 
@@ -239,20 +276,63 @@ typedef struct marker_desc {
 - (int) write_header:(i64 *)shard_scn_map;
 - (int) flush;
 - (void) fadvise_dont_need;
+- (void) fadvise_will_need;
 - (size_t) rows;
 - (i64) last_read_lsn;
+- (off_t) last_read_offset;
 - (const struct row_v12 *) append_row:(const void *)data len:(u32)data_len scn:(i64)scn tag:(u16)tag;
 - (const struct row_v12 *) append_row:(const void *)data len:(u32)data_len shard:(Shard *)shard tag:(u16)tag;
 - (const struct row_v12 *) append_row:(struct row_v12 *)row data:(const void *)data;
 
 - (i64) confirm_write;
+- (int) flush_wet:(off_t *)tail;
 - (void) append_successful:(size_t)bytes;
 - (int) fileno;
 - (int) write_eof_marker;
+
+- (int) enable_mmap;
+- (int) enable_mmap:(size_t)window;
+- (void) mmap_release:(const void *)ptr;
+
+- (void) enable_index:(int)step;
+- (int) write_index;
+- (int) seek_lsn:(i64)lsn;
+- (int) seek_scn:(const i64 *)scn; /* scn map of MAX_SHARD entries */
+- (int) seek_offset:(off_t)offset;
+/* offset rows appended after this call can be read back from, -1 if unknown */
+- (off_t) append_offset;
 @end
 
+/* sparse seek index: every Nth row of xlog and every Nth row of each shard
+   is mapped to file offset. Stored next to xlog as <filename>.idx */
+struct xlog_index_entry {
+	i64 lsn, scn;
+	i64 offset; /* offset of row marker, or of block marker for v13 */
+	u16 shard_id;
+	u16 unused[3];
+} __attribute__((packed));
+
+int xlog_index_rebuild(const char *filename);
+/* generate synthetic snapshot and WALs as described by spec, time their loading */
+int recovery_bench(const char *spec);
+
+/* where rows of a shard are stored: shard unchanged since previous snapshot
+   is written as snap_ref row, and recovery reads its rows from snapshot
+   (part) lsn starting at offset, up to shard_final.
+   <lsn>.snap.refs lists locations of all shards of snapshot */
+struct snap_ref {
+	i64 lsn, scn;
+	i64 offset;	/* of the first row of shard */
+	i16 part;	/* -1 if snapshot isn't split in parts */
+	u16 shard_id;
+	u16 depth;	/* number of subsequent snapshots referring to lsn */
+	u16 unused;
+} __attribute__((packed));
+
 struct tbuf *convert_row_v11_to_v12(struct tbuf *orig);
 void fixup_row_v12(struct row_v12 *);
+int row_v12_verify(struct row_v12 *const *rows, int count, bool header);
+void row_v12_checksum(struct row_v12 *const *rows, const void *const *data, int count);
 u16 fix_tag_v2(u16 tag);
 
 @interface XLog04: XLog
@@ -267,9 +347,55 @@ u16 fix_tag_v2(u16 tag);
 @interface XLog11OG: XLog11 /* OpenGraph XLog format */
 @end
 
-@interface XLog12: XLog
+@interface XLog12: XLog {
+	/* mmap read mode: [fetch_row] returns rows pointing into the mapping */
+	char *map, *prev_map;
+	size_t map_len, prev_map_len;
+	off_t map_offt;	/* file offset of map[0] */
+	off_t map_pos;	/* file offset of the next row */
+	off_t map_file_size;
+	size_t map_window;
+	char *map_released; /* pages of the mapping before it are dropped */
+}
+- (const char *) version_line;
+- (off_t) write_offset;
+- (int) write_row:(const struct row_v12 *)row data:(const void *)data;
+/* [append_row] with crc32c fields already filled */
+- (const struct row_v12 *) append_checksummed_row:(struct row_v12 *)row data:(const void *)data;
 @end
 
+@interface XLog13: XLog12 {
+	char *wblock, *rblock, *zbuf;
+	size_t wblock_size, rblock_size, zbuf_size;
+	size_t wblock_len, rblock_len, rblock_pos;
+	int wblock_rows;
+	off_t failed_offset; /* of first block failed since [confirm_write], 0 if none */
+}
+@end
+
+struct wal_ring;
+
+/* when WAL writer replies to request */
+enum wal_durability {
+	WAL_DURABILITY_DEFAULT = 0,	/* written, fdatasync'ed only when
+					   wal_fsync_delay says it's time to */
+	WAL_DURABILITY_WRITE,		/* written to page cache, reply may overtake
+					   others; falls back to DEFAULT if it can't */
+	WAL_DURABILITY_SYNC,		/* fdatasync'ed; WAL writer panics if
+					   fdatasync fails */
+	WAL_DURABILITY_REPLICATED	/* not supported by WAL writer: POR shard
+					   rejects it, paxos shard ignores durability
+					   since it replies after quorum anyway */
+};
+
+/* WAL commit latency seen by master, mapped shared, so
+   forked snapshot dumper sees it, see snap_io_latency_target */
+struct wal_latency {
+	ev_tstamp commit; /* moving average */
+	ev_tstamp updated;
+};
+extern volatile struct wal_latency *wal_latency;
+
 struct wal_pack {
 	struct netmsg_head *netmsg;
 	struct row_v12 *row;
@@ -277,6 +403,10 @@ struct wal_pack {
 	TAILQ_ENTRY(wal_pack) link;
 	struct Fiber *fiber;
 	i64 epoch, seq;
+
+	struct wal_ring *ring; /* NULL if pack is sent through socket */
+	u64 ring_start; /* ring head before first row of pack */
+	u64 ring_row; /* ring position of last appended row */
 };
 
 struct wal_request {
@@ -285,6 +415,8 @@ struct wal_request {
 	u32 magic;
 	i64 seq;
 	i64 epoch;
+	u32 ring_offt; /* offset of first row in shared ring, if magic is WAL_REQUEST_RING_MAGIC */
+	u8 durability; /* enum wal_durability */
 } __attribute__((packed));
 
 struct wal_reply {
@@ -297,6 +429,7 @@ struct wal_reply {
 
 
 void wal_pack_prepare(XLogWriter *r, struct wal_pack *);
+void wal_pack_set_durability(struct wal_pack *pack, enum wal_durability durability);
 u32 wal_pack_append_row(struct wal_pack *pack, struct row_v12 *row);
 void wal_pack_append_data(struct wal_pack *pack, const void *data, size_t len);
 
@@ -327,6 +460,12 @@ bool our_shard(const struct shard_op *sop);
 - (int) snapshot_write_rows:(XLog *)snap;
 @end
 
+/* optional: -snapshot_write_rows: may run concurrently with the same
+   method of other shards' executors, each in its own thread (see snap_parts) */
+@protocol ExecutorConcurrentSnapshot
+- (bool) snapshot_write_concurrent;
+@end
+
 @protocol RecoveryState
 - (i64) lsn;
 - (Shard<Shard> *) shard:(unsigned)shard_id;
@@ -339,32 +478,63 @@ bool our_shard(const struct shard_op *sop);
 @interface XLogReader : Object {
 	i64 lsn;
 	id<RecoverRow> recovery;
+	XLogDir *dir;
 	XLog *current_wal;
 	ev_timer wal_timer;
+	bool background;
+	i64 readahead_lsn; /* greatest WAL passed to -[XLogDir readahead:after:done:] */
+
+	/* hot standby: inotify watcher of dir and delay between
+	   writing and applying of the last row */
+	ev_io wal_notify;
+	double row_tm;
+	ev_tstamp lag;
 }
 - (id) init_recovery:(id<RecoverRow>)recovery;
+/* background reader yields every few hundred rows, so
+   the rest of server keeps running while it loads */
+- (void) set_background:(bool)flag;
+- (id) init_recovery:(id<RecoverRow>)recovery dir:(XLogDir *)dir;
 - (i64) lsn;
 
 - (i64) load_full:(XLog *)preferred_snap;
 - (i64) load_incr:(XLog *)initial_xlog;
 - (void) hot_standby;
+- (ev_tstamp) lag;
 
 - (void) recover_follow:(ev_tstamp)wal_dir_rescan_delay;
 - (i64) recover_snap;
+- (void) recover_snap_parts:(id)manifest lsn:(i64)snap_lsn;
+- (void) recover_snap_ref:(const struct row_v12 *)ref_row;
 - (void) recover_remaining_wals;
 - (i64) recover_finalize;
 @end
 
 @interface SnapWriter: Object {
 	id<RecoveryState> state;
+
+	/* snapshot point, see -snapshot_freeze */
+	bool frozen, legacy_mode;
+	i64 lsn, *scn;
+	u32 total_rows, legacy_run_crc;
+	struct snap_shard *shard;
+	int shard_count;
 }
 - (id) init_state:(id<RecoveryState>)state;
+/* capture snapshot point: lsn, scn and headers of shards */
+- (void) snapshot_freeze;
+- (void) snapshot_thaw;
 - (int) snapshot_write;
+- (int) snapshot_write_fold_part:(int)n lsn:(i64)lsn;
+/* manifest of parts already on disk */
+- (int) snapshot_write_manifest:(int)parts lsn:(i64)lsn;
 @end
 
 @protocol XLogWriter
 - (i64) lsn;
 - (struct wal_reply *) submit:(const void *)data len:(u32)len tag:(u16)tag shard_id:(u16)shard_id;
+- (struct wal_reply *) submit:(const void *)data len:(u32)len tag:(u16)tag shard_id:(u16)shard_id
+		   durability:(enum wal_durability)durability;
 - (struct wal_reply *) wal_pack_submit;
 @end
 
@@ -378,9 +548,13 @@ bool our_shard(const struct shard_op *sop);
 @public
 	i64 epoch, seq;
 	TAILQ_HEAD(wal_pack_tailq, wal_pack) wal_queue;
+	struct wal_ring *ring;
 }
 - (id) init_lsn:(i64)lsn
 	  state:(id<RecoveryState>)state;
+- (id) init_lsn:(i64)lsn
+	  state:(id<RecoveryState>)state
+	 stream:(int)stream;
 
 - (const struct child *) wal_writer;
 @end
@@ -395,6 +569,7 @@ bool our_shard(const struct shard_op *sop);
 @interface XLogPuller: Object <XLogPuller, XLogPullerAsync> {
 	int fd;
 	struct tbuf rbuf;
+	size_t verified_len; /* prefix of rbuf with already checked crc */
 
 	u32 version;
 	bool abort;
@@ -502,6 +677,7 @@ enum feeder_filter_type {
 - (void) load_from_remote;
 
 - (int) submit:(const void *)data len:(u32)len tag:(u16)tag;
+- (int) submit:(const void *)data len:(u32)len tag:(u16)tag durability:(enum wal_durability)durability;
 
 - (const char *) status;
 - (void) status_update:(const char *)fmt, ...;
@@ -524,20 +700,32 @@ enum feeder_filter_type {
 
 @interface Recovery: Object <RecoveryState, RecoverRow> {
 	XLogReader *reader;
+	XLogReader *stream_reader[WAL_STREAM_MAX]; /* [0] is unused, see reader */
+	i64 stream_lsn[WAL_STREAM_MAX];
 	bool initial_snap, remote_loading;
 
 	SnapWriter *snap_writer;
 	ev_timer snapshot_timer;
 	bool snapshot_running;
 	i64 last_snapshot_lsn;
+
+	/* with cfg.recovery_hot_shards only listed shards are loaded before
+	   writes are enabled, the rest (cold ones) are loaded by background fiber,
+	   cfg.recovery_cold_batch shards per pass */
+	enum { LOAD_ALL, LOAD_HOT, LOAD_DEFERRED } load_phase;
+	int load_pass, cold_passes;
+	int shard_pass[MAX_SHARD]; /* rows of shard are loaded by that pass, -1: not yet scheduled */
+	bool shard_cold[MAX_SHARD]; /* skipped by the first pass */
 @public
-	id<XLogWriter> writer;
+	id<XLogWriter> writer; /* writer of stream 0 */
+	id<XLogWriter> stream_writer[WAL_STREAM_MAX];
 	struct rwlock snapshot_lock;
 	struct mbox_void_ptr run_crc_mbox, rt_notify_mbox;
 	Class default_exec_class;
 }
 - (i64) lsn;
 - (id<XLogWriter>)writer;
+- (id<XLogWriter>)shard_writer:(int)shard_id;
 
 - (void) simple:(struct iproto_service *)service;
 - (void) lock; /* lock wal_dir & snap_dir */
@@ -546,6 +734,7 @@ enum feeder_filter_type {
 
 - (i64) load_from_local; /* load from local snap+wal */
 - (void) enable_local_writes;
+- (void) load_deferred_shards;
 
 - (void) shard_info:(struct tbuf *)buf;
 - (int) write_initial_state;
@@ -36,7 +36,8 @@ struct run_crc {
 	bool mismatch;
 	ev_tstamp verify_tstamp;
 };
-void run_crc_calc(u32 *crc, u16 row_tag, const void *data, int len);
+struct row_v12;
+void run_crc_calc(u32 *crc, const struct row_v12 *row);
 void run_crc_record(struct run_crc* state, struct run_crc_hist entry);
 void run_crc_verify(struct run_crc *run_crc, struct tbuf *buf);
 
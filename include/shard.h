@@ -88,6 +88,7 @@ struct shard_route {
 	Shard<Shard> *shard;
 	struct iproto_egress *proxy;
 	struct rwlock lock;
+	bool loading; /* cold shard is loaded in background, see classify() */
 };
 
 struct shard_conf {
@@ -31,6 +31,122 @@
 #import <say.h>
 #import <third_party/qsort_arg.h>
 
+#ifdef THREADS
+#include <pthread.h>
+#endif
+
+int index_sort_threads = 0;
+
+#ifdef THREADS
+/* parallel sort: every thread qsorts its chunk, then sorted runs are
+   merged pairwise, every pair by its own thread, until one run left */
+#define IXSORT_CHUNK_MIN (64 * 1024)
+
+struct ixsort_job {
+	bool sort;
+	char *src, *dst;
+	size_t a, b, c;	/* sort [a, c) of src, or merge [a, b) and [b, c) into dst */
+	size_t node_size;
+	index_cmp compare;
+	void *arg;
+	pthread_t thread;
+};
+
+static void
+ixsort_merge(struct ixsort_job *job)
+{
+	size_t ns = job->node_size;
+	char *l = job->src + job->a * ns, *le = job->src + job->b * ns,
+	     *r = le, *re = job->src + job->c * ns,
+	     *out = job->dst + job->a * ns;
+
+	while (l < le && r < re) {
+		if (job->compare(l, r, job->arg) <= 0) {
+			memcpy(out, l, ns);
+			l += ns;
+		} else {
+			memcpy(out, r, ns);
+			r += ns;
+		}
+		out += ns;
+	}
+	memcpy(out, l, le - l);
+	memcpy(out + (le - l), r, re - r);
+}
+
+static void *
+ixsort_run(void *arg)
+{
+	struct ixsort_job *job = arg;
+	if (job->sort)
+		qsort_arg(job->src + job->a * job->node_size, job->c - job->a,
+			  job->node_size, job->compare, job->arg);
+	else
+		ixsort_merge(job);
+	return NULL;
+}
+
+/* calling thread does the first job itself */
+static void
+ixsort_spawn(struct ixsort_job *job, int n)
+{
+	for (int i = 1; i < n; i++)
+		if ((errno = pthread_create(&job[i].thread, NULL, ixsort_run, &job[i])) != 0)
+			panic_syserror("pthread_create");
+	ixsort_run(&job[0]);
+	for (int i = 1; i < n; i++)
+		pthread_join(job[i].thread, NULL);
+}
+
+static void
+ixsort_parallel(char *nodes, size_t count, size_t node_size,
+		index_cmp compare, void *arg, int threads)
+{
+	struct ixsort_job job[threads];
+	size_t bound[threads + 1];
+	char *tmp = xmalloc(count * node_size);
+	char *src = nodes, *dst = tmp;
+	int runs = threads;
+
+	for (int i = 0; i <= threads; i++)
+		bound[i] = count * i / threads;
+	for (int i = 0; i < threads; i++)
+		job[i] = (struct ixsort_job){ .sort = true, .src = src,
+					      .a = bound[i], .c = bound[i + 1],
+					      .node_size = node_size,
+					      .compare = compare, .arg = arg };
+	ixsort_spawn(job, threads);
+
+	while (runs > 1) {
+		int n = 0;
+		for (int i = 0; i + 1 < runs; i += 2)
+			job[n++] = (struct ixsort_job){ .src = src, .dst = dst,
+							.a = bound[i], .b = bound[i + 1],
+							.c = bound[i + 2],
+							.node_size = node_size,
+							.compare = compare, .arg = arg };
+		if (runs % 2)
+			memcpy(dst + bound[runs - 1] * node_size, src + bound[runs - 1] * node_size,
+			       (count - bound[runs - 1]) * node_size);
+		ixsort_spawn(job, n);
+
+		int merged = 0;
+		for (int i = 0; i < runs; i += 2)
+			bound[merged++] = bound[i];
+		bound[merged] = count;
+		runs = merged;
+
+		char *t = src;
+		src = dst;
+		dst = t;
+	}
+
+	if (src != nodes)
+		memcpy(nodes, src, count * node_size);
+	free(tmp);
+}
+#endif
+
 @implementation Tree
 
 - (int)
@@ -197,6 +313,12 @@ sort_nodes:(void *)nodes_ count:(size_t)count onduplicate:(ixsort_on_duplicate)o
 {
 	int i;
 	bool no_dups = true;
+#ifdef THREADS
+	int threads = MIN(index_sort_threads, (int)(count / IXSORT_CHUNK_MIN));
+	if (threads > 1)
+		ixsort_parallel(nodes_, count, node_size, compare, dtor_arg, threads);
+	else
+#endif
 	qsort_arg(nodes_, count, node_size, compare, dtor_arg);
 	for (i = 1; i < count; i++) {
 		struct index_node *node = nodes_ + i * node_size;
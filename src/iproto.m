@@ -104,7 +104,9 @@ iproto_worker(va_list ap)
 		fiber->ushard = a.r->shard_id;
 		netmsg_io_retain(a.io);
 
-		struct rwlock *lock = &(shard_rt + a.r->shard_id)->lock;
+		struct shard_route *route = shard_rt + a.r->shard_id;
+		struct rwlock *lock = &route->lock;
+		bool admitted_loading = route->loading;
 		if ((a.ih->flags & IPROTO_WLOCK) == 0)
 			rlock(lock);
 		else
@@ -113,6 +115,9 @@ iproto_worker(va_list ap)
 		ev_tstamp start = ev_now();
 #endif
 		@try {
+			/* cold shard may turn out to be not ours, see classify() */
+			if (unlikely(admitted_loading && route->shard == nil))
+				iproto_raise(ERR_CODE_NONMASTER, "no such shard");
 			a.ih->cb(&a.io->wbuf, a.r);
 		}
 		@catch (Error *e) {
@@ -454,6 +459,13 @@ classify(struct iproto_ingress_svc *io, struct iproto *msg)
 		ih = service_find_code(io->service, msg->msg_code);
 		if (ih->flags & IPROTO_LOCAL)
 			goto local;
+		if (unlikely(route->loading)) {
+			/* cold shard is loaded in background with route->lock write locked:
+			   worker waits for it. Nonblocking handlers don't take the lock */
+			if (orig_msg != msg || ih->flags & IPROTO_NONBLOCK)
+				return error(io, msg, ERR_CODE_NONMASTER, "shard is loading");
+			goto local;
+		}
 		if (orig_msg == msg) { /* not via proxy */
 			if (proxy && (shard == nil || ih->flags & IPROTO_ON_MASTER)) {
 				if (proxy == (void *)0x1)
@@ -34,6 +34,11 @@
 #import <shard.h>
 
 #include <third_party/crc32.h>
+#include <third_party/lz4/lz4.h>
+
+#ifdef THREADS
+#import <thread_pool.h>
+#endif
 
 #include <dirent.h>
 #include <errno.h>
@@ -43,6 +48,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+
+#if HAVE_LINUX_FALLOC_H
+#include <linux/falloc.h>
+#endif
 
 #if !HAVE_DECL_FDATASYNC
 extern int fdatasync(int fd);
@@ -71,6 +81,7 @@ const u32 default_version = 12;
 const u32 version_11 = 11;
 const char *v11 = "0.11\n";
 const char *v12 = "0.12\n";
+const char *v13 = "0.13\n";
 const char *v04 = "0.04\n";
 const char *v03 = "0.03\n";
 const char *snap_mark = "SNAP\n";
@@ -78,6 +89,13 @@ const char *xlog_mark = "XLOG\n";
 const char *inprogress_suffix = ".inprogress";
 const u32 marker = 0xba0babed;
 const u32 eof_marker = 0x10adab1e;
+const u32 block_marker = 0xba0b10c5;
+const u32 index_magic = 0xba0b1dc5;
+const char *index_suffix = ".idx";
+const u32 refs_magic = 0xba0b5e75;
+const char *refs_suffix = ".refs";
+/* hidden and out of <lsn>.xlog* namespace: neither scan_dir nor tools see it */
+static const char *spare_name = ".spare";
 Class version3 = nil;
 Class version4 = nil;
 
@@ -130,6 +148,8 @@ xlog_tag_to_a(u16 tag)
 	case paxos_promise:	strcat(p, "paxos_promise"); break;
 	case paxos_accept:	strcat(p, "paxos_accept"); break;
 	case tlv:		strcat(p, "tlv"); break;
+	case snap_part:		strcat(p, "snap_part"); break;
+	case snap_ref:		strcat(p, "snap_ref"); break;
 	default:
 		if (tag < user_tag)
 			sprintf(p, "sys%i", tag);
@@ -150,10 +170,184 @@ set_file_buf(FILE *fd, const int bufsize)
 	return vbuf;
 }
 
+/* sparse seek index, see struct xlog_index_entry.
+   File is xlog_index_header followed by count entries. file_size is size
+   of xlog at the moment index was written: index is ignored if xlog doesn't match */
+struct xlog_index_header {
+	u32 magic;
+	u32 count;
+	u32 crc32c;	/* of entries */
+	u32 unused;
+	i64 file_size;
+} __attribute__((packed));
+
+struct xlog_index {
+	int step;
+	u32 rows;	/* rows since last entry */
+	u32 shard_rows[MAX_SHARD];
+	struct xlog_index_entry *entry;
+	u32 count, size;
+};
+
+static void
+xlog_index_add(struct xlog_index *index, const struct row_v12 *row, off_t offset)
+{
+	bool add = index->rows % index->step == 0 ||
+		   index->shard_rows[row->shard_id] % index->step == 0;
+	index->rows++;
+	index->shard_rows[row->shard_id]++;
+	if (!add)
+		return;
+
+	if (index->count == index->size) {
+		index->size = index->size ? index->size * 2 : 64;
+		index->entry = xrealloc(index->entry, index->size * sizeof(*index->entry));
+	}
+	index->entry[index->count++] = (struct xlog_index_entry){ .lsn = row->lsn,
+								  .scn = row->scn,
+								  .offset = offset,
+								  .shard_id = row->shard_id };
+	index->rows = 1;
+}
+
+/* drop entries of rows which weren't confirmed */
+static void
+xlog_index_truncate(struct xlog_index *index, i64 next_lsn)
+{
+	while (index->count > 0 && index->entry[index->count - 1].lsn >= next_lsn)
+		index->count--;
+}
+
+/* sidecar file <filename><suffix> is xlog_index_header followed by count
+   entries. It's ignored unless it matches current size of filename */
+static void *
+sidecar_load(const char *filename, const char *suffix, u32 magic,
+	     size_t entry_size, u32 *count)
+{
+	char sidecar_filename[PATH_MAX + 1];
+	struct xlog_index_header h;
+	void *entry = NULL;
+	struct stat st;
+	FILE *file;
+
+	snprintf(sidecar_filename, sizeof(sidecar_filename), "%s%s", filename, suffix);
+	if ((file = fopen(sidecar_filename, "r")) == NULL)
+		return NULL;
+
+	if (fread(&h, sizeof(h), 1, file) != 1 || h.magic != magic) {
+		say_warn("bad header in %s", sidecar_filename);
+		goto out;
+	}
+	if (stat(filename, &st) < 0 || st.st_size != h.file_size) {
+		say_warn("stale %s", sidecar_filename);
+		goto out;
+	}
+
+	entry = xmalloc(h.count * entry_size ?: 1);
+	if (fread(entry, entry_size, h.count, file) != h.count ||
+	    crc32c(0, (const u8 *)entry, h.count * entry_size) != h.crc32c)
+	{
+		say_warn("corrupted %s", sidecar_filename);
+		free(entry);
+		entry = NULL;
+		goto out;
+	}
+	*count = h.count;
+out:
+	fclose(file);
+	return entry;
+}
+
+static int
+sidecar_store(const char *filename, const char *suffix, u32 magic,
+	      const void *entry, size_t entry_size, u32 count)
+{
+	char sidecar_filename[PATH_MAX + 1];
+	struct xlog_index_header h = { .magic = magic,
+				       .count = count };
+	struct stat st;
+	FILE *file;
+
+	if (stat(filename, &st) < 0) {
+		say_syserror("can't stat %s", filename);
+		return -1;
+	}
+	h.file_size = st.st_size;
+	h.crc32c = crc32c(0, (const u8 *)entry, count * entry_size);
+
+	snprintf(sidecar_filename, sizeof(sidecar_filename), "%s%s", filename, suffix);
+	if ((file = fopen(sidecar_filename, "w")) == NULL) {
+		say_syserror("fopen of %s for writing failed", sidecar_filename);
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, file) != 1 ||
+	    fwrite(entry, entry_size, count, file) != count)
+	{
+		say_syserror("can't write %s", sidecar_filename);
+		fclose(file);
+		unlink(sidecar_filename);
+		return -1;
+	}
+	if (fclose(file) < 0) {
+		say_syserror("can't close %s", sidecar_filename);
+		unlink(sidecar_filename);
+		return -1;
+	}
+	return 0;
+}
+
+static struct xlog_index_entry *
+xlog_index_load(const char *filename, u32 *count)
+{
+	return sidecar_load(filename, index_suffix, index_magic,
+			    sizeof(struct xlog_index_entry), count);
+}
+
+static int
+xlog_index_store(const char *filename, const struct xlog_index *index)
+{
+	return sidecar_store(filename, index_suffix, index_magic,
+			     index->entry, sizeof(*index->entry), index->count);
+}
+
+/* snapshot writers stage rows, checksum them by batches and throttle I/O,
+   see snap_append_row() */
+struct snap_io {
+	size_t bytes;
+	ev_tstamp step_ts, last_ts;
+	ev_tstamp adapt_ts;
+	double rate; /* adaptive rate limit, see snap_rate_limit() */
+	char *stage;
+	size_t stage_len, stage_size;
+	int stage_rows;
+};
+
+@interface Snap12 : XLog12 {
+	struct snap_io io;
+}
+@end
+
+/* Snap13: v13 snapshot. Blocks are (de)compressed by worker threads,
+   up to job_ring blocks in flight; they're written and read in order */
+struct snap13_job;
+@class Snap13Worker;
+@interface Snap13 : XLog13 {
+	struct snap_io io;
+#ifdef THREADS
+	Snap13Worker *worker;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	struct snap13_job *job;
+	int job_ring, job_head, job_count;
+#endif
+}
+@end
+
 @implementation XLog
 - (bool) eof { return eof; }
 - (u32) version { return 0; }
 - (i64) last_read_lsn { return last_read_lsn; }
+- (off_t) last_read_offset { return last_read_offset; }
 
 - (XLog *)
 init_filename:(const char *)filename_
@@ -215,6 +409,11 @@ open_for_read_filename:(const char *)filename dir:(XLogDir *)dir
 #endif
 	} else if (strcmp(version_, v12) == 0) {
 		l = [XLog12 alloc];
+	} else if (strcmp(version_, v13) == 0) {
+		if ([dir isKindOf:[SnapDir class]])
+			l = [Snap13 alloc];
+		else
+			l = [XLog13 alloc];
 	} else if (strcmp(version_, v04) == 0) {
 		if (version4 != nil) {
 			l = [version4 alloc];
@@ -267,7 +466,7 @@ free
 	ev_stat_stop(&stat);
 
 	if (mode == LOG_READ && rows == 0 && access(filename, F_OK) == 0) {
-		bool legacy_snap = ![self isMemberOf:[XLog12 class]] &&
+		bool legacy_snap = ![self isKindOf:[XLog12 class]] &&
 				   [dir isMemberOf:[SnapDir class]];
 		if (!legacy_snap)
 			panic("no valid rows were read");
@@ -279,6 +478,13 @@ free
 		[self close];
 	}
 
+	if (index) {
+		if (!inprogress)
+			[self write_index];
+		free(index->entry);
+		free(index);
+	}
+
 	free(wet_rows_offset);
 	free(filename);
 	free(vbuf);
@@ -395,6 +601,15 @@ fadvise_dont_need
 #endif
 }
 
+/* start readahead of the whole file, it's going to be read soon */
+- (void)
+fadvise_will_need
+{
+#if HAVE_POSIX_FADVISE
+	posix_fadvise(fileno(fd), ftello(fd), 0, POSIX_FADV_WILLNEED);
+#endif
+}
+
 - (int)
 write_header:(const i64 *)shard_scn_map
 {
@@ -475,6 +690,7 @@ restart:
 		magic |= ((u64)c & 0xff) << magic_shift;
 	}
 	marker_offset = ftello(fd) - mdesc.size;
+	last_read_offset = marker_offset;
 	if (good_offset != marker_offset)
 		say_warn("skipped %" PRIofft " bytes after %08" PRIofft " offset",
 			 marker_offset - good_offset, good_offset);
@@ -592,7 +808,11 @@ append_row:(struct row_v12 *)row data:(const void *)data
 - (const struct row_v12 *)
 append_row:(const void *)data len:(u32)len scn:(i64)scn tag:(u16)tag
 {
+#ifdef THREADS
+	static __thread struct row_v12 row; /* snapshot parts are written by threads */
+#else
 	static struct row_v12 row;
+#endif
 	row = (struct row_v12){ .scn = scn,
 				.tm = ev_now(),
 				.tag = tag,
@@ -604,7 +824,11 @@ append_row:(const void *)data len:(u32)len scn:(i64)scn tag:(u16)tag
 - (const struct row_v12 *)
 append_row:(const void *)data len:(u32)len shard:(Shard *)shard tag:(u16)tag
 {
+#ifdef THREADS
+	static __thread struct row_v12 row; /* snapshot parts are written by threads */
+#else
 	static struct row_v12 row;
+#endif
 	row = (struct row_v12){ .scn = shard->scn,
 				.tm = ev_now(),
 				.tag = tag,
@@ -614,6 +838,19 @@ append_row:(const void *)data len:(u32)len shard:(Shard *)shard tag:(u16)tag
 	return [self append_row:&row data:data];
 }
 
+/* push wet rows to the file.
+   on failure *tail is set to the end of data actually written */
+- (int)
+flush_wet:(off_t *)tail
+{
+	if (fflush(fd) < 0) {
+		say_syserror("fflush");
+		*tail = ftello(fd);
+		return -1;
+	}
+	return 0;
+}
+
 - (i64)
 confirm_write
 {
@@ -628,14 +865,11 @@ confirm_write
 	if (wet_rows == 0)
 		goto exit;
 
-	if (fflush(fd) < 0) {
-		say_syserror("fflush");
-
-		tail = ftello(fd);
+	if ([self flush_wet:&tail] < 0) {
 
 		say_debug3("%s offset:%llu tail:%lli", __func__, (long long)offset, (long long)tail);
 
-		off_t confirmed_offset = 0;
+		off_t confirmed_offset = offset; /* drop partial write even if no row is confirmed */
 		for (int i = 0; i < wet_rows; i++) {
 			if (wet_rows_offset[i] > tail) {
 				say_error("failed to sync %lli rows", (long long)(wet_rows - i));
@@ -657,6 +891,8 @@ confirm_write
 		next_lsn += wet_rows;
 		rows += wet_rows;
 	}
+	if (index)
+		xlog_index_truncate(index, next_lsn);
 #if HAVE_SYNC_FILE_RANGE
 	sync_bytes += tail - offset;
 	if (unlikely(sync_bytes > 32 * 4096)) {
@@ -677,6 +913,128 @@ fileno
 {
 	return fileno(fd);
 }
+
+/* switch reader to mmap mode, if supported by format */
+- (int)
+enable_mmap
+{
+	return [self enable_mmap:0];
+}
+
+- (int)
+enable_mmap:(size_t)window
+{
+	(void)window;
+	return -1;
+}
+
+- (void)
+mmap_release:(const void *)ptr
+{
+	(void)ptr;
+}
+
+/* collect seek index of rows appended from now on, see [write_index] */
+- (void)
+enable_index:(int)step
+{
+	assert(mode == LOG_WRITE);
+	if (step <= 0 || index != NULL)
+		return;
+	index = xcalloc(1, sizeof(*index));
+	index->step = step;
+}
+
+- (int)
+write_index
+{
+	assert(index != NULL);
+	return xlog_index_store(filename, index);
+}
+
+/* position freshly opened xlog at the last indexed row with LSN <= lsn.
+   Never seeks backward. returns -1 if there is no usable index,
+   stream position is unchanged then */
+- (int)
+seek_lsn:(i64)target_lsn
+{
+	u32 count = 0;
+	struct xlog_index_entry *entry, *found = NULL;
+
+	if (mode != LOG_READ || rows != 0)
+		return -1;
+	if ((entry = xlog_index_load(filename, &count)) == NULL)
+		return -1;
+
+	for (u32 i = 0; i < count && entry[i].lsn <= target_lsn; i++)
+		found = &entry[i];
+
+	int ret = -1;
+	if (found != NULL && found->offset > ftello(fd) &&
+	    fseeko(fd, found->offset, SEEK_SET) == 0)
+	{
+		say_debug("%s: LSN:%"PRIi64" offset:%"PRIi64, __func__, found->lsn, found->offset);
+		ret = 0;
+	}
+	free(entry);
+	return ret;
+}
+
+/* position freshly opened xlog so that no row of shard i with SCN > scn[i]
+   is skipped: i.e. at the lowest offset among shards of the last indexed row
+   of shard with SCN <= scn[i] + 1 (rows before it are older), or of the first
+   one (it's the first row of shard in xlog). Shards missing in index have
+   no rows here. Never seeks backward */
+- (int)
+seek_scn:(const i64 *)scn
+{
+	u32 count = 0;
+	struct xlog_index_entry *entry;
+	i64 *bound;
+	i64 target = -1;
+
+	if (mode != LOG_READ || rows != 0)
+		return -1;
+	if ((entry = xlog_index_load(filename, &count)) == NULL)
+		return -1;
+
+	bound = xmalloc(MAX_SHARD * sizeof(*bound));
+	for (int i = 0; i < MAX_SHARD; i++)
+		bound[i] = -1;
+	for (u32 i = 0; i < count; i++) {
+		int shard_id = entry[i].shard_id;
+		if (bound[shard_id] < 0 || entry[i].scn <= scn[shard_id] + 1)
+			bound[shard_id] = entry[i].offset;
+	}
+	for (int i = 0; i < MAX_SHARD; i++)
+		if (bound[i] >= 0 && (target < 0 || bound[i] < target))
+			target = bound[i];
+
+	int ret = -1;
+	if (target > ftello(fd) && fseeko(fd, target, SEEK_SET) == 0) {
+		say_debug("%s: offset:%"PRIi64, __func__, target);
+		ret = 0;
+	}
+	free(bound);
+	free(entry);
+	return ret;
+}
+
+/* position freshly opened xlog at offset of row marker (or v13 block marker),
+   e.g. the one of struct snap_ref */
+- (int)
+seek_offset:(off_t)offset
+{
+	if (mode != LOG_READ || rows != 0)
+		return -1;
+	return fseeko(fd, offset, SEEK_SET);
+}
+
+- (off_t)
+append_offset
+{
+	return -1;
+}
 @end
 
 @implementation XLog04
@@ -949,9 +1307,11 @@ append_row:(struct row_v12 *)row12 data:(const void *)data
 	row.tm = ev_now();
 	row.len = sizeof(tag) + sizeof(cookie) + data_len;
 
+	/* keep row12->data_crc32c valid: WAL writer derives run_crc from it */
+	row12->data_crc32c = crc32c(0, data, data_len);
 	row.data_crc32c = crc32c(0, (void *)&tag, sizeof(tag));
 	row.data_crc32c = crc32c(row.data_crc32c, (void *)&cookie, sizeof(cookie));
-	row.data_crc32c = crc32c(row.data_crc32c, data, data_len);
+	row.data_crc32c = crc32c_combine(row.data_crc32c, row12->data_crc32c, data_len);
 
 	row.header_crc32c = crc32c(0, (unsigned char *)&row + sizeof(row.header_crc32c),
 				   sizeof(row) - sizeof(row.header_crc32c));
@@ -1155,9 +1515,11 @@ append_row:(struct row_v12 *)row12 data:(const void *)data
 	row.tm = ev_now();
 	row.len = sizeof(tag) + sizeof(cookie) + data_len;
 
+	/* keep row12->data_crc32c valid: WAL writer derives run_crc from it */
+	row12->data_crc32c = crc32c(0, data, data_len);
 	row.data_crc32c = crc32c(0, (void *)&tag, sizeof(tag));
 	row.data_crc32c = crc32c(row.data_crc32c, (void *)&cookie, sizeof(cookie));
-	row.data_crc32c = crc32c(row.data_crc32c, data, data_len);
+	row.data_crc32c = crc32c_combine(row.data_crc32c, row12->data_crc32c, data_len);
 
 	row.header_crc32c = crc32c(0, (unsigned char *)&row + sizeof(row.header_crc32c),
 				   sizeof(row) - sizeof(row.header_crc32c));
@@ -1182,6 +1544,7 @@ append_row:(struct row_v12 *)row12 data:(const void *)data
 
 @implementation XLog12
 - (u32) version { return 12; }
+- (const char *) version_line { return v12; }
 
 - (int)
 read_header
@@ -1202,7 +1565,7 @@ read_header
 write_header:(const i64 *)shard_scn_map
 {
 	fwrite(dir->filetype, strlen(dir->filetype), 1, fd);
-	fwrite(v12, strlen(v12), 1, fd);
+	fwrite([self version_line], strlen([self version_line]), 1, fd);
 	fprintf(fd, "Created-by: octopus\n");
 	fprintf(fd, "Octopus-version: %s\n", octopus_version());
 	if (shard_scn_map) {
@@ -1221,6 +1584,32 @@ write_header:(const i64 *)shard_scn_map
 	return 0;
 }
 
+/* file offset of the next appended row */
+- (off_t)
+write_offset
+{
+	return ftello(fd);
+}
+
+- (off_t)
+append_offset
+{
+	return [self write_offset];
+}
+
+- (int)
+write_row:(const struct row_v12 *)row data:(const void *)data
+{
+	if (fwrite(&marker, sizeof(marker), 1, fd) != 1 ||
+	    fwrite(row, sizeof(*row), 1, fd) != 1 ||
+	    fwrite(data, row->len, 1, fd) != 1)
+	{
+		say_syserror("fwrite");
+		return -1;
+	}
+	return 0;
+}
+
 u16
 fix_tag_v2(u16 tag)
 {
@@ -1257,6 +1646,75 @@ fix_tag_v3(u16 tag)
 	}
 }
 
+#define ROW_CRC_BATCH 16
+
+/* returns number of leading rows with valid crc32c. Header crc is checked
+   only if requested: rows received from feeder may be modified in flight
+   and carry stale header_crc32c */
+int
+row_v12_verify(struct row_v12 *const *rows, int count, bool header)
+{
+	const unsigned char *buf[ROW_CRC_BATCH];
+	unsigned int len[ROW_CRC_BATCH];
+	u32 crc[ROW_CRC_BATCH];
+
+	for (int i = 0; i < count; i += ROW_CRC_BATCH) {
+		int n = MIN(count - i, ROW_CRC_BATCH);
+
+		if (header) {
+			for (int j = 0; j < n; j++) {
+				buf[j] = (u8 *)rows[i + j] + offsetof(struct row_v12, lsn);
+				len[j] = sizeof(struct row_v12) - offsetof(struct row_v12, lsn);
+				crc[j] = 0;
+			}
+			crc32c_multi(crc, buf, len, n);
+			for (int j = 0; j < n; j++)
+				if (rows[i + j]->header_crc32c != crc[j])
+					return i + j;
+		}
+
+		for (int j = 0; j < n; j++) {
+			buf[j] = rows[i + j]->data;
+			len[j] = rows[i + j]->len;
+			crc[j] = 0;
+		}
+		crc32c_multi(crc, buf, len, n);
+		for (int j = 0; j < n; j++)
+			if (rows[i + j]->data_crc32c != crc[j])
+				return i + j;
+	}
+	return count;
+}
+
+/* fill data_crc32c and header_crc32c of rows; data[i] is payload of rows[i] */
+void
+row_v12_checksum(struct row_v12 *const *rows, const void *const *data, int count)
+{
+	const unsigned char *buf[ROW_CRC_BATCH];
+	unsigned int len[ROW_CRC_BATCH];
+	u32 crc[ROW_CRC_BATCH];
+
+	for (int i = 0; i < count; i += ROW_CRC_BATCH) {
+		int n = MIN(count - i, ROW_CRC_BATCH);
+
+		for (int j = 0; j < n; j++) {
+			buf[j] = data[i + j];
+			len[j] = rows[i + j]->len;
+			crc[j] = 0;
+		}
+		crc32c_multi(crc, buf, len, n);
+		for (int j = 0; j < n; j++) {
+			rows[i + j]->data_crc32c = crc[j];
+			buf[j] = (u8 *)rows[i + j] + sizeof(rows[i + j]->header_crc32c);
+			len[j] = sizeof(struct row_v12) - sizeof(rows[i + j]->header_crc32c);
+			crc[j] = 0;
+		}
+		crc32c_multi(crc, buf, len, n);
+		for (int j = 0; j < n; j++)
+			rows[i + j]->header_crc32c = crc[j];
+	}
+}
+
 void
 fixup_row_v12(struct row_v12 *row)
 {
@@ -1324,473 +1782,2014 @@ read_row
 	return m->ptr;
 }
 
-- (const struct row_v12 *)
-append_row:(struct row_v12 *)row data:(const void *)data
-{
-	assert_row(row);
-
-	row->lsn = [self next_lsn];
-	row->scn = row->scn ?: row->lsn;
-	row->data_crc32c = crc32c(0, data, row->len);
-	row->header_crc32c = crc32c(0, (unsigned char *)row + sizeof(row->header_crc32c),
-				   sizeof(*row) - sizeof(row->header_crc32c));
+/* mmap read mode.
+   File is mapped by windows of XLOG_MAP_WINDOW bytes, MAP_PRIVATE so
+   [fixup_row_v12] can patch rows in place. Rows point into the mapping:
+   row is valid until the window after the next one is mapped.
+   Only complete files (ending with eof_marker) are mapped: they never change,
+   and access beyond the end of file can't happen.
+   With window == SIZE_MAX whole file is mapped at once and rows stay valid
+   until [mmap_release] */
 
-#if LOG_IO_ERROR_INJECT
-	const void *ptr = data;
-	int len = row->len;
-	while ((ptr = memmem(ptr, len, "sleep", 5))) {
-		sleep(3);
-		ptr += 5;
-		len = row->len - (ptr - data);
-	}
-	if (memmem(data, row->len, "error", 5))
-		return NULL;
-#endif
+#define XLOG_MAP_WINDOW (64 * 1024 * 1024)
 
-	if (fwrite(&marker, sizeof(marker), 1, fd) != 1 ||
-	    fwrite(row, sizeof(*row), 1, fd) != 1 ||
-	    fwrite(data, row->len, 1, fd) != 1)
-	{
-		say_syserror("fwrite");
-		return NULL;
-	}
+- (int)
+enable_mmap:(size_t)window
+{
+	struct stat st;
+	u32 tail;
 
-	[self append_successful:sizeof(marker) + sizeof(*row) + row->len];
-	return row;
-}
+	if (mode != LOG_READ || rows != 0 || map != NULL || [self version] != 12)
+		return -1;
 
-@end
+	if (fstat(fileno(fd), &st) < 0 || st.st_size < (off_t)sizeof(tail))
+		return -1;
+	if (pread(fileno(fd), &tail, sizeof(tail), st.st_size - sizeof(tail)) != sizeof(tail) ||
+	    tail != eof_marker)
+		return -1;
 
-@implementation XLogDir
-- (id)
-init_dirname:(const char *)dirname_
-{
-        dirname = dirname_;
-	fd = open(dirname, O_RDONLY);
-	if (fd < 0)
-		panic("can't open dir: %s: %s", dirname, strerror_o(errno));
-	xlog_class = [XLog12 class];
-        return self;
+	map_file_size = st.st_size;
+	map_window = window ?: XLOG_MAP_WINDOW;
+	map_pos = ftello(fd);
+	map_offt = 0;
+	map_len = 0;
+	if (map_pos < 0)
+		return -1;
+	return 0;
 }
 
-- (int)
-sync
+/* pointer to file range [offt, offt + len), remapping window if needed.
+   NULL if range is beyond end of file */
+- (char *)
+map_at:(off_t)offt len:(size_t)len
 {
-	return fsync(fd);
-}
+	if (offt + (off_t)len > map_file_size)
+		return NULL;
 
-- (id)
-free
-{
-	close(fd);
-	return [super free];
-}
+	if (map != NULL && offt >= map_offt && offt + (off_t)len <= map_offt + (off_t)map_len)
+		return map + (offt - map_offt);
 
-- (int)
-lock
+	off_t start = offt & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t size = MAX(map_window, offt + len - start);
+	if (size > (size_t)(map_file_size - start))
+		size = map_file_size - start;
+
+	char *ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fileno(fd), start);
+	if (ptr == MAP_FAILED) {
+		say_syserror("mmap");
+		return NULL;
+	}
+#if HAVE_MADVISE
+	madvise(ptr, size, MADV_SEQUENTIAL);
+	madvise(ptr, size, MADV_WILLNEED);
+#endif
+	/* rows of the current window are still valid during next one */
+	if (prev_map)
+		munmap(prev_map, prev_map_len);
+	prev_map = map;
+	prev_map_len = map_len;
+	map = ptr;
+	map_len = size;
+	map_offt = start;
+	map_released = map;
+	return map + (offt - map_offt);
+}
+
+/* rows before ptr won't be accessed anymore: drop their pages, so
+   mapping of the whole file doesn't pin it in memory */
+- (void)
+mmap_release:(const void *)ptr
 {
-	return flock(fd, LOCK_EX|LOCK_NB);
+	if (map == NULL || (const char *)ptr < map || (const char *)ptr >= map + map_len)
+		return;
+	size_t len = ((const char *)ptr - map_released) & ~(XLOG_MAP_WINDOW - 1);
+	if (len == 0)
+		return;
+#if HAVE_MADVISE
+	madvise(map_released, len, MADV_DONTNEED);
+#endif
+	map_released += len;
 }
 
-- (int)
-stat:(struct stat *)buf
+- (struct row_v12 *)
+map_fetch_row
+{
+	off_t good_offset = map_pos, pos = map_pos;
+	struct row_v12 *row;
+	char *p;
+
+restart:
+	while ((p = [self map_at:pos len:sizeof(marker)]) != NULL && *(u32 *)p != marker)
+		pos++;
+	if (p == NULL)
+		goto eof;
+
+	if (good_offset != pos)
+		say_warn("skipped %" PRIofft " bytes after %08" PRIofft " offset",
+			 pos - good_offset, good_offset);
+
+	row = (void *)[self map_at:pos + sizeof(marker) len:sizeof(*row)];
+	if (row == NULL)
+		goto eof;
+
+	if (row->header_crc32c != crc32c(0, (u8 *)row + offsetof(struct row_v12, lsn),
+					 sizeof(*row) - offsetof(struct row_v12, lsn)))
+	{
+		say_error("header crc32c mismatch");
+		goto bad_row;
+	}
+
+	row = (void *)[self map_at:pos + sizeof(marker) len:sizeof(*row) + row->len];
+	if (row == NULL)
+		goto eof;
+
+	if (row->data_crc32c != crc32c(0, row->data, row->len)) {
+		say_error("data crc32c mismatch");
+		goto bad_row;
+	}
+
+	fixup_row_v12(row);
+	say_debug2("%s: LSN:%" PRIi64, __func__, row->lsn);
+
+	last_read_offset = pos;
+	map_pos = pos + sizeof(marker) + sizeof(*row) + row->len;
+	++rows;
+	last_read_lsn = row->lsn;
+	return row;
+
+bad_row:
+	say_warn("failed to read row");
+	pos++;
+	goto restart;
+eof:
+	p = [self map_at:good_offset len:sizeof(eof_marker)];
+	if (p != NULL && *(u32 *)p == eof_marker &&
+	    good_offset + (off_t)sizeof(eof_marker) == map_file_size)
+	{
+		map_pos = map_file_size;
+		eof = 1;
+	}
+	return NULL;
+}
+
+- (struct row_v12 *)
+fetch_row
+{
+	if (map_file_size)
+		return [self map_fetch_row];
+	return [super fetch_row];
+}
+
+- (int)
+close
+{
+	if (map_file_size)
+		fseeko(fd, map_pos, SEEK_SET); /* keep [XLog close] fadvise range right */
+	if (map)
+		munmap(map, map_len);
+	if (prev_map)
+		munmap(prev_map, prev_map_len);
+	map = prev_map = NULL;
+	map_len = prev_map_len = 0;
+	map_file_size = 0;
+	return [super close];
+}
+
+- (const struct row_v12 *)
+append_row:(struct row_v12 *)row data:(const void *)data
+{
+	assert_row(row);
+
+	row->lsn = [self next_lsn];
+	row->scn = row->scn ?: row->lsn;
+	row->data_crc32c = crc32c(0, data, row->len);
+	row->header_crc32c = crc32c(0, (unsigned char *)row + sizeof(row->header_crc32c),
+				   sizeof(*row) - sizeof(row->header_crc32c));
+
+	return [self append_checksummed_row:row data:data];
+}
+
+- (const struct row_v12 *)
+append_checksummed_row:(struct row_v12 *)row data:(const void *)data
+{
+#if LOG_IO_ERROR_INJECT
+	const void *ptr = data;
+	int len = row->len;
+	while ((ptr = memmem(ptr, len, "sleep", 5))) {
+		sleep(3);
+		ptr += 5;
+		len = row->len - (ptr - data);
+	}
+	if (memmem(data, row->len, "error", 5))
+		return NULL;
+#endif
+
+	off_t row_offset = index ? [self write_offset] : 0;
+	if ([self write_row:row data:data] < 0)
+		return NULL;
+
+	if (index)
+		xlog_index_add(index, row, row_offset);
+	[self append_successful:sizeof(marker) + sizeof(*row) + row->len];
+	return row;
+}
+
+@end
+
+/* XLog13: rows are grouped in LZ4 compressed blocks, one block per
+   [confirm_write] (i.e. per WAL writer batch), but no larger than XLOG13_BLOCK_MAX.
+   Block is block_marker, struct xlog13_block and payload. Uncompressed payload
+   is a sequence of row_v12 with data, exactly as they're stored in v12.
+   Payload is stored uncompressed if it doesn't compress. */
+
+#define XLOG13_BLOCK_MAX (1024 * 1024)
+
+struct xlog13_block {
+	u32 header_crc32c;	/* crc32c of the rest of header */
+	u32 data_crc32c;	/* crc32c of payload as stored */
+	u32 rows;
+	u32 raw_len;		/* length of uncompressed payload */
+	u32 len;		/* length of stored payload */
+} __attribute__((packed));
+
+static void
+buf_reserve(char **buf, size_t *size, size_t len)
+{
+	if (*size >= len)
+		return;
+	size_t new_size = *size ?: 64 * 1024;
+	while (new_size < len)
+		new_size *= 2;
+	*buf = xrealloc(*buf, new_size);
+	*size = new_size;
+}
+
+/* fills h->len and crcs, h->raw_len bytes of raw are compressed into *zbuf.
+   returns payload to store: *zbuf, or raw itself if it doesn't compress */
+static const char *
+xlog13_compress(struct xlog13_block *h, const char *raw, char **zbuf, size_t *zbuf_size)
+{
+	buf_reserve(zbuf, zbuf_size, h->raw_len);
+	const char *payload = *zbuf;
+	int len = LZ4_compress_limitedOutput(raw, *zbuf, h->raw_len, h->raw_len - 1);
+	if (len <= 0) { /* incompressible */
+		payload = raw;
+		len = h->raw_len;
+	}
+	h->len = len;
+	h->data_crc32c = crc32c(0, (const u8 *)payload, h->len);
+	h->header_crc32c = crc32c(0, (const u8 *)h + sizeof(h->header_crc32c),
+				  sizeof(*h) - sizeof(h->header_crc32c));
+	return payload;
+}
+
+/* reads header and stored payload of block following block_marker */
+static int
+xlog13_read_block(FILE *fd, struct xlog13_block *h, char **buf, size_t *size)
+{
+	if (fread(h, sizeof(*h), 1, fd) != 1) {
+		if (ferror(fd))
+			say_error("fread error");
+		return -1;
+	}
+
+	if (h->header_crc32c != crc32c(0, (const u8 *)h + sizeof(h->header_crc32c),
+				       sizeof(*h) - sizeof(h->header_crc32c)))
+	{
+		say_error("block header crc32c mismatch");
+		return -1;
+	}
+
+	buf_reserve(buf, size, h->len);
+	if (fread(*buf, h->len, 1, fd) != 1) {
+		if (ferror(fd))
+			say_error("fread error");
+		return -1;
+	}
+	return 0;
+}
+
+/* verifies stored payload and decompresses it into *buf.
+   returns raw payload: *buf, or payload itself if stored uncompressed */
+static const char *
+xlog13_decompress(const struct xlog13_block *h, const char *payload, char **buf, size_t *size)
+{
+	if (h->data_crc32c != crc32c(0, (const u8 *)payload, h->len)) {
+		say_error("block data crc32c mismatch");
+		return NULL;
+	}
+
+	if (h->len == h->raw_len)
+		return payload;
+
+	buf_reserve(buf, size, h->raw_len);
+	if (LZ4_decompress_safe(payload, *buf, h->len, h->raw_len) != (int)h->raw_len) {
+		say_error("block decompression failed");
+		return NULL;
+	}
+	return *buf;
+}
+
+@implementation XLog13
+- (u32) version { return 13; }
+- (const char *) version_line { return v13; }
+
+- (marker_desc_t)
+marker_desc
+{
+	return (marker_desc_t){
+		.marker = (u64)block_marker,
+		.eof = (u64)eof_marker,
+		.size = 4,
+		.eof_size = 4
+	};
+}
+
+- (int)
+write_block
+{
+	struct xlog13_block h = { .rows = wblock_rows,
+				  .raw_len = wblock_len };
+	const char *payload = xlog13_compress(&h, wblock, &zbuf, &zbuf_size);
+
+	off_t end = LLONG_MAX; /* rows of failed block are never confirmed */
+	off_t start = ftello(fd);
+	int ret = 0;
+
+	/* rows of the block are indexed by offset of the block */
+	if (index) {
+		for (u32 i = index->count; i > 0 && index->entry[i - 1].offset < 0; i--)
+			index->entry[i - 1].offset = start;
+	}
+
+	if (fwrite(&block_marker, sizeof(block_marker), 1, fd) != 1 ||
+	    fwrite(&h, sizeof(h), 1, fd) != 1 ||
+	    fwrite(payload, h.len, 1, fd) != 1)
+	{
+		say_syserror("fwrite");
+		/* [flush_wet] stops confirmation at the first failed block,
+		   rows appended after it are discarded too */
+		if (failed_offset == 0)
+			failed_offset = start;
+		ret = -1;
+	} else {
+		end = ftello(fd);
+	}
+
+	/* whole block is either written or not */
+	if (!no_wet)
+		for (int i = wet_rows - wblock_rows; i < wet_rows; i++)
+			wet_rows_offset[i] = end;
+
+	wblock_len = 0;
+	wblock_rows = 0;
+	return ret;
+}
+
+/* rows are buffered until [write_block], offset is fixed up there */
+- (off_t)
+write_offset
+{
+	return -1;
+}
+
+/* next row starts new block */
+- (off_t)
+append_offset
+{
+	if (wblock_rows > 0 && [self write_block] < 0)
+		return -1;
+	return ftello(fd);
+}
+
+- (int)
+write_row:(const struct row_v12 *)row data:(const void *)data
+{
+	size_t len = sizeof(*row) + row->len;
+
+	if (wblock_rows > 0 && wblock_len + len > XLOG13_BLOCK_MAX &&
+	    [self write_block] < 0)
+		return -1;
+
+	buf_reserve(&wblock, &wblock_size, wblock_len + len);
+	memcpy(wblock + wblock_len, row, sizeof(*row));
+	memcpy(wblock + wblock_len + sizeof(*row), data, row->len);
+	wblock_len += len;
+	wblock_rows++;
+	return 0;
+}
+
+- (int)
+flush_wet:(off_t *)tail
+{
+	if (wblock_rows > 0)
+		[self write_block];
+
+	int ret = [super flush_wet:tail];
+	if (failed_offset > 0) {
+		if (ret == 0 || *tail > failed_offset)
+			*tail = failed_offset;
+		failed_offset = 0;
+		return -1;
+	}
+	return ret;
+}
+
+- (int)
+write_eof_marker
+{
+	if (wblock_rows > 0 && [self write_block] < 0)
+		return -1;
+	return [super write_eof_marker];
+}
+
+- (struct row_v12 *)
+next_block_row
+{
+	if (rblock_pos == rblock_len)
+		return NULL;
+
+	const struct row_v12 *r = (const void *)(rblock + rblock_pos);
+	if (rblock_len - rblock_pos < sizeof(*r) ||
+	    rblock_len - rblock_pos < sizeof(*r) + r->len)
+	{
+		say_error("truncated row in block");
+		rblock_pos = rblock_len;
+		return NULL;
+	}
+
+	size_t len = sizeof(*r) + r->len;
+	struct row_v12 *row = palloc(fiber->pool, len);
+	memcpy(row, r, len);
+	rblock_pos += len;
+
+	fixup_row_v12(row);
+	say_debug2("%s: LSN:%" PRIi64, __func__, row->lsn);
+	return row;
+}
+
+- (struct row_v12 *)
+read_row
+{
+	struct xlog13_block h;
+
+	if (xlog13_read_block(fd, &h, &zbuf, &zbuf_size) < 0)
+		return NULL;
+
+	const char *raw = xlog13_decompress(&h, zbuf, &rblock, &rblock_size);
+	if (raw == NULL)
+		return NULL;
+	if (raw != rblock) {
+		buf_reserve(&rblock, &rblock_size, h.raw_len);
+		memcpy(rblock, raw, h.raw_len);
+	}
+	rblock_len = h.raw_len;
+	rblock_pos = 0;
+
+	return [self next_block_row];
+}
+
+- (struct row_v12 *)
+fetch_row
+{
+	struct row_v12 *row = [self next_block_row];
+	if (row == NULL)
+		return [super fetch_row];
+
+	++rows;
+	last_read_lsn = row->lsn;
+	return row;
+}
+
+- (int)
+close
+{
+	free(wblock);
+	free(rblock);
+	free(zbuf);
+	wblock = rblock = zbuf = NULL;
+	wblock_size = rblock_size = zbuf_size = 0;
+	wblock_len = rblock_len = rblock_pos = 0;
+	return [super close];
+}
+
+@end
+
+/* XLog12Batch: WAL writer backend bypassing stdio.
+   Rows are copied once into page aligned batch buffer and the whole batch
+   is written by pwrite() from [confirm_write]. In "direct" mode file is
+   additionally opened with O_DIRECT: batch always starts on block boundary,
+   partial tail block is kept in buffer and rewritten by next batch.
+   Zero padding after the last row is truncated on close. */
+
+#define XLOG_BATCH_ALIGN 4096
+
+@interface XLog12Batch : XLog12 {
+	char *batch;	/* batch[0] is at file offset batch_offt */
+	size_t batch_len, batch_size;
+	off_t batch_offt;
+	bool direct;
+	int dio_fd;
+}
+@end
+
+@implementation XLog12Batch
+
+- (int)
+batch_reserve:(size_t)len
+{
+	if (batch_len + len <= batch_size)
+		return 0;
+
+	size_t size = batch_size ?: 1024 * 1024;
+	while (size < batch_len + len)
+		size *= 2;
+
+	void *ptr;
+	if ((errno = posix_memalign(&ptr, XLOG_BATCH_ALIGN, size)) != 0) {
+		say_syserror("posix_memalign");
+		return -1;
+	}
+	if (batch_len)
+		memcpy(ptr, batch, batch_len);
+	free(batch);
+	batch = ptr;
+	batch_size = size;
+	return 0;
+}
+
+- (void)
+batch_append:(const void *)data len:(size_t)len
+{
+	memcpy(batch + batch_len, data, len);
+	batch_len += len;
+}
+
+/* drop everything before file offset end, keeping partial block in direct mode */
+- (void)
+batch_reset:(off_t)end
+{
+	off_t start = direct ? end & ~(off_t)(XLOG_BATCH_ALIGN - 1) : end;
+	assert(start >= batch_offt);
+	memmove(batch, batch + (start - batch_offt), end - start);
+	batch_len = end - start;
+	batch_offt = start;
+}
+
+- (int)
+write_header:(const i64 *)shard_scn_map
+{
+	if ([super write_header:shard_scn_map] < 0)
+		return -1;
+	if (fflush(fd) < 0)
+		return -1;
+
+	direct = strcmp(cfg.wal_writer_io, "direct") == 0;
+	batch_offt = direct ? offset & ~(off_t)(XLOG_BATCH_ALIGN - 1) : offset;
+	batch_len = 0;
+	if ([self batch_reserve:offset - batch_offt] < 0)
+		return -1;
+
+	if (direct) {
+		/* header is in page cache, read back its tail block */
+		batch_len = offset - batch_offt;
+		if (pread(fileno(fd), batch, batch_len, batch_offt) != (ssize_t)batch_len)
+			return -1;
+
+		dio_fd = open(filename, O_WRONLY|O_DIRECT);
+		if (dio_fd < 0) {
+			say_syserror("can't open %s with O_DIRECT", filename);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+- (off_t)
+write_offset
+{
+	return batch_offt + batch_len;
+}
+
+- (int)
+write_row:(const struct row_v12 *)row data:(const void *)data
+{
+	/* in direct mode batch is padded up to block size */
+	if ([self batch_reserve:sizeof(marker) + sizeof(*row) + row->len + XLOG_BATCH_ALIGN] < 0)
+		return -1;
+
+	[self batch_append:&marker len:sizeof(marker)];
+	[self batch_append:row len:sizeof(*row)];
+	[self batch_append:data len:row->len];
+	return 0;
+}
+
+- (int)
+flush_wet:(off_t *)tail
+{
+	size_t len = direct ? TYPEALIGN(XLOG_BATCH_ALIGN, batch_len) : batch_len;
+	int wfd = direct ? dio_fd : fileno(fd);
+	size_t done = 0;
+
+	memset(batch + batch_len, 0, len - batch_len);
+	while (done < len) {
+		ssize_t r = pwrite(wfd, batch + done, len - done, batch_offt + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		done += r;
+	}
+
+	off_t end = batch_offt + batch_len;
+	if (done < len) {
+		say_syserror("pwrite");
+		/* only completely written rows are confirmed */
+		off_t written = batch_offt + done;
+		end = offset;
+		for (int i = 0; i < wet_rows && wet_rows_offset[i] <= written; i++)
+			end = wet_rows_offset[i];
+		*tail = end;
+		[self batch_reset:end];
+		return -1;
+	}
+
+	[self batch_reset:end];
+	return 0;
+}
+
+- (int)
+write_eof_marker
+{
+	assert(mode == LOG_WRITE);
+	assert(fd != NULL);
+
+	off_t tail;
+	if ([self batch_reserve:sizeof(eof_marker) + XLOG_BATCH_ALIGN] < 0)
+		return -1;
+	[self batch_append:&eof_marker len:sizeof(eof_marker)];
+	if ([self flush_wet:&tail] < 0) {
+		say_error("can't write eof_marker");
+		return -1;
+	}
+	offset = batch_offt + batch_len;
+
+	if ([self flush] == -1)
+		return -1;
+
+	if ([self close] == -1)
+		return -1;
+	return 0;
+}
+
+- (int)
+close
+{
+	if (fd != NULL && direct) {
+		/* drop block padding */
+		off_t end = batch_offt + batch_len;
+		if (ftruncate(dio_fd, end) < 0)
+			say_syserror("ftruncate");
+		close(dio_fd);
+		direct = false;
+	}
+	free(batch);
+	batch = NULL;
+	batch_len = batch_size = 0;
+	return [super close];
+}
+
+@end
+
+@implementation XLogDir
+- (id)
+init_dirname:(const char *)dirname_
+{
+        dirname = dirname_;
+	fd = open(dirname, O_RDONLY);
+	if (fd < 0)
+		panic("can't open dir: %s: %s", dirname, strerror_o(errno));
+	xlog_class = [XLog12 class];
+        return self;
+}
+
+- (int)
+sync
+{
+	return fsync(fd);
+}
+
+- (id)
+free
+{
+	close(fd);
+	return [super free];
+}
+
+- (int)
+lock
+{
+	return flock(fd, LOCK_EX|LOCK_NB);
+}
+
+- (int)
+stat:(struct stat *)buf
 {
 	return fstat(fd, buf);
 }
 
 static int
-cmp_i64(const void *_a, const void *_b)
+cmp_i64(const void *_a, const void *_b)
+{
+	const i64 *a = _a, *b = _b;
+	if (*a == *b)
+		return 0;
+	return (*a > *b) ? 1 : -1;
+}
+
+- (ssize_t)
+scan_dir:(i64 **)ret_lsn
+{
+	DIR *dh = NULL;
+	struct dirent *dent;
+	i64 *lsn;
+	size_t i = 0, size = 1024;
+	char *parse_suffix;
+	ssize_t result = -1;
+
+	dh = opendir(dirname);
+	if (dh == NULL)
+		goto out;
+
+	lsn = palloc(fiber->pool, sizeof(i64) * size);
+	if (lsn == NULL)
+		goto out;
+
+	errno = 0;
+	while ((dent = readdir(dh)) != NULL) {
+		char *file_suffix = strrchr(dent->d_name, '.');
+
+		if (file_suffix == NULL)
+			continue;
+
+		bool valid_suffix = strcmp(file_suffix, suffix) == 0;
+		if (!valid_suffix)
+			continue;
+
+		lsn[i] = strtoll(dent->d_name, &parse_suffix, 10);
+		if (strncmp(parse_suffix, suffix, strlen(suffix)) != 0) {
+			/* d_name doesn't parse entirely, ignore it */
+			say_warn("can't parse `%s', skipping", dent->d_name);
+			continue;
+		}
+
+		if (lsn[i] == LLONG_MAX || lsn[i] == LLONG_MIN) {
+			say_warn("can't parse `%s', skipping", dent->d_name);
+			continue;
+		}
+
+		i++;
+		if (i == size) {
+			i64 *n = palloc(fiber->pool, sizeof(i64) * size * 2);
+			if (n == NULL)
+				goto out;
+			memcpy(n, lsn, sizeof(i64) * size);
+			lsn = n;
+			size = size * 2;
+		}
+	}
+
+	qsort(lsn, i, sizeof(i64), cmp_i64);
+
+	*ret_lsn = lsn;
+	result = i;
+      out:
+	if (errno != 0)
+		say_syserror("error reading directory `%s'", dirname);
+
+	if (dh != NULL)
+		closedir(dh);
+	return result;
+}
+
+- (i64)
+greatest_lsn
+{
+	i64 *lsn;
+	ssize_t count = [self scan_dir:&lsn];
+
+	if (count <= 0)
+		return count;
+
+	return lsn[count - 1];
+}
+
+- (i64)
+least_lsn
+{
+	i64 *lsn;
+	ssize_t count = [self scan_dir:&lsn];
+
+	if (count <= 0)
+		return count;
+
+	return lsn[0];
+}
+
+- (XLog *)
+containg_lsn:(i64)target_lsn
+{
+	i64 *lsn;
+	ssize_t count = [self scan_dir:&lsn];
+
+	if (count <= 0)
+		return nil;
+
+	if (target_lsn < *lsn) {
+		say_warn("%s: requested LSN:%"PRIi64" is missing", __func__, target_lsn);
+		return nil;
+	}
+
+	while (count > 1) {
+		if (*lsn <= target_lsn && target_lsn < *(lsn + 1))
+			goto out;
+		lsn++;
+		count--;
+	}
+
+	/*
+	 * we can't check here for sure will or will not last file
+	 * contain record with desired lsn since number of rows in file
+	 * is not known beforehand. so, we simply return the last one.
+	 */
+out:
+	say_debug2("%s: target_lsn:%"PRIi64 " file_lsn:%"PRIi64, __func__, target_lsn, *lsn);
+	return [self open_for_read:*lsn];
+}
+
+
+- (const char *)
+format_filename:(i64)lsn suffix:(const char *)extra_suffix into:(char *)filename
+{
+	snprintf(filename, PATH_MAX + 1, "%s/%020" PRIi64 "%s%s",
+		 dirname, lsn, suffix, extra_suffix);
+	return filename;
+}
+
+/* result is valid until next call by the same thread:
+   snapshot parts are written by threads */
+- (const char *)
+format_filename:(i64)lsn prefix:(const char *)prefix suffix:(const char *)extra_suffix
+{
+	static __thread char filename[PATH_MAX + 1];
+	snprintf(filename, sizeof(filename),
+		 "%s%s/%020" PRIi64 "%s%s",
+		 prefix, dirname, lsn, suffix, extra_suffix);
+	return filename;
+}
+
+- (const char *)
+format_filename:(i64)lsn suffix:(const char *)extra_suffix
+{
+	return [self format_filename:lsn prefix:"" suffix:extra_suffix];
+}
+
+- (const char *)
+format_filename:(i64)lsn
+{
+	return [self format_filename:lsn suffix:""];
+}
+
+
+- (XLog *)
+open_for_read:(i64)lsn
+{
+	const char *filename = [self format_filename:lsn];
+	XLog *xlog = [XLog open_for_read_filename:filename dir:self];
+	if (xlog)
+		xlog->lsn = lsn;
+	return xlog;
+}
+
+/* part of snapshot, see -[SnapWriter snapshot_write_parts:] */
+- (XLog *)
+open_for_read:(i64)lsn part:(int)part
+{
+	char part_suffix[16];
+	snprintf(part_suffix, sizeof(part_suffix), ".part%03i", part);
+	XLog *xlog = [XLog open_for_read_filename:[self format_filename:lsn suffix:part_suffix]
+					      dir:self];
+	if (xlog)
+		xlog->lsn = lsn;
+	return xlog;
+}
+
+int allow_snap_overwrite = 0;
+- (XLog *)
+open_for_write:(i64)lsn scn:(i64 *)shard_scn_map
+{
+	return [self open_for_write:lsn scn:shard_scn_map part:-1];
+}
+
+- (XLog *)
+open_for_write:(i64)lsn scn:(i64 *)shard_scn_map part:(int)part
+{
+        XLog *l = nil;
+        FILE *file = NULL;
+        assert(lsn > 0);
+	char *fbuf = NULL;
+	char part_suffix[16] = "", suffix_[32];
+	char filename[PATH_MAX + 1], spare_filename[PATH_MAX + 1];
+
+	if (part >= 0)
+		snprintf(part_suffix, sizeof(part_suffix), ".part%03i", part);
+
+	const char *final_filename = [self format_filename:lsn suffix:part_suffix];
+	if (!allow_snap_overwrite && access(final_filename, F_OK) == 0) {
+		errno = EEXIST;
+		say_error("failed to create '%s': file already exists", final_filename);
+		goto error;
+	}
+
+	snprintf(suffix_, sizeof(suffix_), "%s%s", part_suffix, inprogress_suffix);
+	[self format_filename:lsn suffix:suffix_ into:filename];
+	off_t alloced = 0;
+
+	if (spare != NULL && part < 0) {
+		snprintf(spare_filename, sizeof(spare_filename), "%s/%s", dirname, spare_name);
+		if (rename(spare_filename, filename) == 0) {
+			file = spare;
+			fbuf = spare_vbuf;
+			alloced = spare_alloced;
+		} else {
+			say_syserror("can't rename spare to %s", filename);
+			fclose(spare);
+			free(spare_vbuf);
+		}
+		spare = NULL;
+		spare_vbuf = NULL;
+	}
+
+	/* .inprogress file can't contain confirmed records, overwrite it silently */
+	if (file == NULL) {
+		file = fopen(filename, "w");
+		if (file == NULL) {
+			say_syserror("fopen of %s for writing failed", filename);
+			goto error;
+		}
+		fbuf = set_file_buf(file, 1024 * 1024);
+	}
+
+	l = [[xlog_class alloc] init_filename:filename fd:file dir:self vbuf:fbuf];
+	l->alloced = alloced;
+
+	/* reset local variables: they are included in l */
+	fbuf = NULL;
+	file = NULL;
+
+	l->next_lsn = lsn;
+	l->mode = LOG_WRITE;
+	l->inprogress = 1;
+
+	if ([l write_header:shard_scn_map] < 0) {
+		say_syserror("failed to write header");
+		goto error;
+	}
+
+	return l;
+      error:
+        if (file != NULL)
+                fclose(file);
+	free(fbuf);
+        [l free];
+	return NULL;
+}
+
+
+/* create and preallocate file for the next [open_for_write] in advance,
+   so opening of new xlog is just rename */
+- (int)
+prepare_spare
+{
+	if (spare != NULL)
+		return 0;
+
+	char filename[PATH_MAX + 1];
+	snprintf(filename, sizeof(filename), "%s/%s", dirname, spare_name);
+	FILE *file = fopen(filename, "w");
+	if (file == NULL) {
+		say_syserror("fopen of %s for writing failed", filename);
+		return -1;
+	}
+
+	spare_alloced = 0;
+#if HAVE_FALLOCATE && defined(FALLOC_FL_KEEP_SIZE)
+	if (fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, 1024 * 1024) == 0)
+		spare_alloced = 1024 * 1024;
+	else
+		say_syserror("fallocate");
+#endif
+	spare_vbuf = set_file_buf(file, 1024 * 1024);
+	spare = file;
+	return 0;
+}
+
+- (bool)
+has_spare
+{
+	return spare != NULL;
+}
+
+static i64
+find(int count, const char *type, i64 needle, i64 *haystack, i64 *lsn)
+{
+	haystack += count - 1;
+	lsn += count - 1;
+
+	while (count) {
+		if (*haystack < 0) /* error */
+			return -1;
+		/* if *haystack == 0 то вернуть последний файл, потому что мы не знаем заранее ,
+		 есть ли в этом файле нужная запись или нет */
+		if (*haystack <= needle) {
+			say_debug2("%s: %s:%"PRIi64 " file_lsn:%"PRIi64, __func__, type, needle, *lsn);
+			return *lsn;
+		}
+
+		haystack--;
+		lsn--;
+		count --;
+	}
+
+	say_warn("%s: requested %s:%"PRIi64" is missing", __func__, type, needle);
+	return -1;
+}
+
+- (i64 *)
+scan_scn_shard:(int)target_shard_id lsn:(i64 *)lsn count:(int)count
+{
+	i64 *scn = p0alloc(fiber->pool, sizeof(i64) * count);
+
+	/* scn[i] == -1 if error,
+	              0 if not present
+		      b otherwise */
+
+	for (int i = 0; i < count; i++) {
+		const char *filename = [self format_filename:lsn[i]];
+		FILE *file = fopen(filename, "r");
+		if (file == NULL) {
+			say_syserror("fopen of %s for reading failed", filename);
+			scn[i] = -1;
+			continue;
+		}
+
+		for (;;) {
+			i64 tmp;
+			int shard_id;
+			char buf[256];
+
+			if (fgets(buf, sizeof(buf), file) == NULL) {
+				say_syserror("fgets");
+				scn[i] = -1;
+				break;
+			}
+
+			if (strcmp(buf, "\n") == 0 || strcmp(buf, "\r\n") == 0)
+				break;
+
+			if (sscanf(buf, "SCN-%i: %"PRIi64, &shard_id, &tmp) == 2) {
+				if (target_shard_id == shard_id) {
+					scn[i] = tmp;
+					break;
+				}
+			}
+		}
+	}
+	return scn;
+}
+
+- (XLog *)
+find_with_lsn:(i64)lsn
+{
+	i64 *dir_lsn;
+	ssize_t count = [self scan_dir:&dir_lsn];
+
+	i64 file_lsn = find(count, "LSN", lsn, dir_lsn, dir_lsn);
+	if (file_lsn <= 0)
+		return nil;
+	return [self open_for_read:file_lsn];
+}
+
+/* start kernel readahead of up to count files following file_lsn.
+   files up to *done_lsn were advised already and are skipped */
+- (void)
+readahead:(int)count after:(i64)file_lsn done:(i64 *)done_lsn
+{
+#if HAVE_POSIX_FADVISE
+	i64 *dir_lsn;
+	ssize_t total = [self scan_dir:&dir_lsn];
+
+	for (ssize_t i = 0; i < total && count > 0; i++) {
+		if (dir_lsn[i] <= file_lsn)
+			continue;
+		count--;
+		if (dir_lsn[i] <= *done_lsn)
+			continue;
+
+		const char *filename = [self format_filename:dir_lsn[i]];
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			say_syserror("can't open `%s'", filename);
+			return;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+		say_debug("%s: `%s'", __func__, filename);
+		*done_lsn = dir_lsn[i];
+	}
+#else
+	(void)count; (void)file_lsn; (void)done_lsn;
+#endif
+}
+
+- (XLog *)
+find_with_scn:(i64)scn shard:(int)shard_id
+{
+	i64 *dir_lsn, *dir_scn;
+	ssize_t count = [self scan_dir:&dir_lsn];
+	dir_scn = [self scan_scn_shard:shard_id lsn:dir_lsn count:count];
+
+	i64 file_lsn = find(count, "SCN", scn, dir_scn, dir_lsn);
+	if (file_lsn <= 0)
+		return nil;
+	return [self open_for_read:file_lsn];
+}
+
+/* SCN of shards from file header. Only shards present in header are set */
+static int
+read_scn_map(const char *filename, i64 *header_scn)
+{
+	FILE *file = fopen(filename, "r");
+	if (file == NULL) {
+		say_syserror("fopen of %s for reading failed", filename);
+		return -1;
+	}
+
+	for (;;) {
+		i64 tmp;
+		int shard_id;
+		char buf[256];
+
+		if (fgets(buf, sizeof(buf), file) == NULL) {
+			say_syserror("fgets");
+			fclose(file);
+			return -1;
+		}
+
+		if (strcmp(buf, "\n") == 0 || strcmp(buf, "\r\n") == 0)
+			break;
+
+		if (sscanf(buf, "SCN-%i: %"PRIi64, &shard_id, &tmp) == 2) {
+			if (shard_id >= 0 && shard_id < MAX_SHARD)
+				header_scn[shard_id] = tmp;
+		} else if (sscanf(buf, "SCN: %"PRIi64, &tmp) == 1) {
+			header_scn[0] = tmp;
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+- (int)
+scn_map:(i64 *)scn lsn:(i64)lsn part:(int)part
+{
+	char part_suffix[16] = "";
+	if (part >= 0)
+		snprintf(part_suffix, sizeof(part_suffix), ".part%03i", part);
+	return read_scn_map([self format_filename:lsn suffix:part_suffix], scn);
+}
+
+/* LSN of the greatest WAL, such that rows following scn[i] of every shard
+   are in it or in the later WALs. scn[i] < 0 means shard i doesn't matter.
+   Shard missing in WAL header didn't exist when WAL was created,
+   so all its rows are in that WAL or later.
+   returns 0 if directory is empty, -1 on error */
+- (i64)
+find_with_scn_map:(const i64 *)scn
+{
+	i64 *dir_lsn;
+	ssize_t count = [self scan_dir:&dir_lsn];
+	if (count <= 0)
+		return count;
+
+	i64 *header_scn = palloc(fiber->pool, sizeof(i64) * MAX_SHARD);
+	for (ssize_t i = count - 1; i >= 0; i--) {
+		memset(header_scn, 0, sizeof(i64) * MAX_SHARD);
+		if (read_scn_map([self format_filename:dir_lsn[i]], header_scn) < 0)
+			return -1;
+
+		/* header holds SCN of the next row of shard */
+		bool found = true;
+		for (int j = 0; j < MAX_SHARD && found; j++)
+			if (scn[j] >= 0 && header_scn[j] > scn[j] + 1)
+				found = false;
+
+		if (found) {
+			say_debug2("%s: file_lsn:%"PRIi64, __func__, dir_lsn[i]);
+			return dir_lsn[i];
+		}
+	}
+
+	say_warn("%s: some rows are missing in `%s', starting from the oldest WAL", __func__, dirname);
+	return dir_lsn[0];
+}
+
+- (int)
+remove_older:(i64)lsn
+{
+	i64 *dir_lsn;
+	ssize_t count = [self scan_dir:&dir_lsn];
+	int removed = 0;
+
+	for (ssize_t i = 0; i < count && dir_lsn[i] < lsn; i++) {
+		const char *filename = [self format_filename:dir_lsn[i]];
+		if (unlink(filename) < 0) {
+			say_syserror("unlink(%s)", filename);
+			break;
+		}
+		say_info("removed `%s'", filename);
+		unlink([self format_filename:dir_lsn[i] suffix:index_suffix]);
+		removed++;
+	}
+	return removed;
+}
+
+@end
+
+@implementation WALDir
+- (XLogDir *)
+init_dirname:(const char *)dirname_
+{
+        if ((self = [super init_dirname:dirname_])) {
+		filetype = xlog_mark;
+		suffix = ".xlog";
+
+		if (strcmp(cfg.wal_writer_io, "pwrite") == 0 ||
+		    strcmp(cfg.wal_writer_io, "direct") == 0)
+			xlog_class = [XLog12Batch class];
+		else if (strcmp(cfg.wal_writer_io, "stdio") != 0)
+			panic("unknown wal_writer_io `%s'", cfg.wal_writer_io);
+
+		if (cfg.wal_compress) {
+			if (xlog_class != [XLog12 class])
+				say_warn("wal_compress: wal_writer_io `%s' is ignored", cfg.wal_writer_io);
+			xlog_class = [XLog13 class];
+		}
+	}
+	return self;
+}
+@end
+
+#define SNAP_STAGE_ROWS 32
+#define SNAP_STAGE_SIZE (256 * 1024)
+
+static int
+snap_stage_flush(XLog12 *log, struct snap_io *io)
 {
-	const i64 *a = _a, *b = _b;
-	if (*a == *b)
-		return 0;
-	return (*a > *b) ? 1 : -1;
+	struct row_v12 *stage_row[SNAP_STAGE_ROWS];
+	const void *stage_data[SNAP_STAGE_ROWS];
+	char *p = io->stage;
+	int n = io->stage_rows;
+
+	for (int i = 0; i < n; i++) {
+		stage_row[i] = (struct row_v12 *)p;
+		stage_data[i] = stage_row[i]->data;
+		p += sizeof(struct row_v12) + stage_row[i]->len;
+	}
+	row_v12_checksum(stage_row, stage_data, n);
+
+	io->stage_len = 0;
+	io->stage_rows = 0;
+	for (int i = 0; i < n; i++) {
+		if ([log append_checksummed_row:stage_row[i] data:stage_row[i]->data] == NULL)
+			return -1;
+		io->bytes += sizeof(struct row_v12) + stage_row[i]->len;
+	}
+	return 0;
 }
 
-- (ssize_t)
-scan_dir:(i64 **)ret_lsn
+#define SNAP_RATE_MIN (1 << 20)
+#define SNAP_RATE_MAX (1 << 30)
+
+/* with snap_io_latency_target the limit adapts to WAL commit latency: every
+   100ms it's halved if latency is above target, otherwise raised by 1/8 up to
+   snap_io_rate_limit. Latency not updated for a second means no writes at all */
+static int
+snap_rate_limit(struct snap_io *io, ev_tstamp now)
 {
-	DIR *dh = NULL;
-	struct dirent *dent;
-	i64 *lsn;
-	size_t i = 0, size = 1024;
-	char *parse_suffix;
-	ssize_t result = -1;
+	int limit = cfg.snap_io_rate_limit * 1024 * 1024;
+	if (cfg.snap_io_latency_target <= 0 || wal_latency == NULL)
+		return limit;
 
-	dh = opendir(dirname);
-	if (dh == NULL)
-		goto out;
+	if (io->rate == 0)
+		io->rate = limit > 0 ? limit : SNAP_RATE_MAX / 16;
 
-	lsn = palloc(fiber->pool, sizeof(i64) * size);
-	if (lsn == NULL)
-		goto out;
+	if (now - io->adapt_ts >= 0.1) {
+		io->adapt_ts = now;
+		if (now - wal_latency->updated < 1 &&
+		    wal_latency->commit > cfg.snap_io_latency_target)
+			io->rate = MAX(io->rate / 2, SNAP_RATE_MIN);
+		else
+			io->rate = MIN(io->rate + io->rate / 8, limit > 0 ? limit : SNAP_RATE_MAX);
+	}
+	return io->rate;
+}
 
-	errno = 0;
-	while ((dent = readdir(dh)) != NULL) {
-		char *file_suffix = strrchr(dent->d_name, '.');
+static const struct row_v12 *
+snap_append_row(XLog12 *log, struct snap_io *io, struct row_v12 *row12, const void *data)
+{
+	assert_row(row12);
 
-		if (file_suffix == NULL)
-			continue;
+	row12->lsn = [log next_lsn];
+	row12->scn = row12->scn ?: row12->lsn;
 
-		bool valid_suffix = strcmp(file_suffix, suffix) == 0;
-		if (!valid_suffix)
-			continue;
+	size_t len = sizeof(*row12) + row12->len;
+	if (io->stage_len + len > io->stage_size) {
+		if (io->stage_rows > 0 && snap_stage_flush(log, io) < 0)
+			return NULL;
+		if (len > io->stage_size) {
+			io->stage_size = MAX(len, SNAP_STAGE_SIZE);
+			io->stage = xrealloc(io->stage, io->stage_size);
+		}
+	}
+	memcpy(io->stage + io->stage_len, row12, sizeof(*row12));
+	memcpy(io->stage + io->stage_len + sizeof(*row12), data, row12->len);
+	io->stage_len += len;
+	io->stage_rows++;
 
-		lsn[i] = strtoll(dent->d_name, &parse_suffix, 10);
-		if (strncmp(parse_suffix, suffix, strlen(suffix)) != 0) {
-			/* d_name doesn't parse entirely, ignore it */
-			say_warn("can't parse `%s', skipping", dent->d_name);
-			continue;
+	if (io->stage_rows < SNAP_STAGE_ROWS && io->stage_len < SNAP_STAGE_SIZE)
+		return row12;
+
+	if (snap_stage_flush(log, io) < 0)
+		return NULL;
+
+	/* snapshot may be written by a thread: use ev_time(), not ev_loop clock */
+	ev_tstamp now = ev_time();
+	if (io->last_ts == 0) {
+		io->last_ts = now;
+		io->step_ts = now;
+	}
+
+	const int io_rate_limit = snap_rate_limit(io, now);
+	if (io_rate_limit <= 0) {
+		if (now - io->step_ts > 0.1) {
+			if ([log flush] < 0)
+				return NULL;
+			if (cfg.snap_fadvise_dont_need)
+				[log fadvise_dont_need];
+			io->step_ts = ev_time();
 		}
+		return row12;
+	}
 
-		if (lsn[i] == LLONG_MAX || lsn[i] == LLONG_MIN) {
-			say_warn("can't parse `%s', skipping", dent->d_name);
-			continue;
+	if (now - io->step_ts > 0.02) {
+		double delta = now - io->last_ts;
+		size_t bps = io->bytes / delta;
+
+		if (bps > io_rate_limit) {
+			if ([log flush] < 0)
+				return NULL;
+			if (cfg.snap_fadvise_dont_need)
+				[log fadvise_dont_need];
+			now = ev_time();
+			delta = now - io->last_ts;
+			bps = io->bytes / delta;
 		}
 
-		i++;
-		if (i == size) {
-			i64 *n = palloc(fiber->pool, sizeof(i64) * size * 2);
-			if (n == NULL)
-				goto out;
-			memcpy(n, lsn, sizeof(i64) * size);
-			lsn = n;
-			size = size * 2;
+		if (bps > io_rate_limit) {
+			double sec = delta * (bps - io_rate_limit) / io_rate_limit;
+			usleep(sec * 1e6);
+			now = ev_time();
 		}
+		io->step_ts = now;
 	}
 
-	qsort(lsn, i, sizeof(i64), cmp_i64);
+	if (now > io->last_ts + 1) {
+		io->bytes = 0;
+		io->last_ts = io->step_ts = now;
+	}
 
-	*ret_lsn = lsn;
-	result = i;
-      out:
-	if (errno != 0)
-		say_syserror("error reading directory `%s'", dirname);
+	return row12;
+}
 
-	if (dh != NULL)
-		closedir(dh);
-	return result;
+/* rows still staged on close are from aborted snapshot */
+static void
+snap_io_free(struct snap_io *io)
+{
+	free(io->stage);
+	memset(io, 0, sizeof(*io));
 }
 
-- (i64)
-greatest_lsn
+@implementation Snap12
+- (const struct row_v12 *)
+append_row:(struct row_v12 *)row12 data:(const void *)data
 {
-	i64 *lsn;
-	ssize_t count = [self scan_dir:&lsn];
+	return snap_append_row(self, &io, row12, data);
+}
 
-	if (count <= 0)
-		return count;
+/* staged rows are yet to be written */
+- (off_t)
+append_offset
+{
+	off_t offset = [super append_offset];
+	if (offset < 0)
+		return -1;
+	return offset + io.stage_len + sizeof(marker) * io.stage_rows;
+}
 
-	return lsn[count - 1];
+- (int)
+flush
+{
+	if (io.stage_rows > 0 && snap_stage_flush(self, &io) < 0)
+		return -1;
+	return [super flush];
 }
 
-- (XLog *)
-containg_lsn:(i64)target_lsn
+- (int)
+write_eof_marker
 {
-	i64 *lsn;
-	ssize_t count = [self scan_dir:&lsn];
+	if (io.stage_rows > 0 && snap_stage_flush(self, &io) < 0)
+		return -1;
+	return [super write_eof_marker];
+}
 
-	if (count <= 0)
-		return nil;
+- (int)
+close
+{
+	snap_io_free(&io);
+	return [super close];
+}
+@end
 
-	if (target_lsn < *lsn) {
-		say_warn("%s: requested LSN:%"PRIi64" is missing", __func__, target_lsn);
-		return nil;
+#ifdef THREADS
+struct snap13_job {
+	thread_pool_request request; /* returned to -[ThreadWorker thread_loop:] */
+	struct snap13_job *next; /* in Snap13Worker queue */
+	struct xlog13_block h;
+	off_t offset;		/* of block_marker, when read */
+	bool compress, done;
+	int ret;
+	/* compress: in is raw payload, stored one is either in or out.
+	   decompress: in is stored payload, raw one is either in or out */
+	char *in, *out;
+	size_t in_size, out_size;
+	const char *payload;
+	pthread_mutex_t *mtx;
+	pthread_cond_t *cond;
+};
+
+static void
+snap13_job_run(struct snap13_job *job)
+{
+	if (job->compress) {
+		job->payload = xlog13_compress(&job->h, job->in, &job->out, &job->out_size);
+		job->ret = 0;
+	} else {
+		job->payload = xlog13_decompress(&job->h, job->in, &job->out, &job->out_size);
+		job->ret = job->payload != NULL ? 0 : -1;
 	}
+}
 
-	while (count > 1) {
-		if (*lsn <= target_lsn && target_lsn < *(lsn + 1))
-			goto out;
-		lsn++;
-		count--;
+/* Snap13Worker: jobs are queued without -[ThreadWorker send:]:
+   snapshot parts are written by non-main threads (see snap_parts) and
+   thread_requests_send() touches main ev_loop */
+@interface Snap13Worker : ThreadWorker {
+	pthread_mutex_t queue_mtx;
+	pthread_cond_t queue_cond;
+	struct snap13_job *first, **last;
+	bool stop;
+}
+- (void) push:(struct snap13_job *)job;
+@end
+
+@implementation Snap13Worker
+static thread_pool_request snap13_stop; /* req.cb == NULL stops thread_loop */
+
+- (id)
+init_num:(int)n
+{
+	/* threads start popping right away */
+	pthread_mutex_init(&queue_mtx, NULL);
+	pthread_cond_init(&queue_cond, NULL);
+	first = NULL;
+	last = &first;
+	stop = false;
+	return [super init_num:n];
+}
+
+- (void)
+push:(struct snap13_job *)job
+{
+	job->request.req = (thread_request){ .cb = (thread_callback)1,
+					     .arg = { .p = job } };
+	job->next = NULL;
+	pthread_mutex_lock(&queue_mtx);
+	*last = job;
+	last = &job->next;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_mtx);
+}
+
+/* used only by -[ThreadWorker close] */
+- (void)
+send_req:(thread_request)req
+{
+	assert(req.cb == NULL);
+	pthread_mutex_lock(&queue_mtx);
+	stop = true;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_mtx);
+}
+
+- (thread_pool_request *)
+pop_request:(thread_pool_waiter *)waiter
+{
+	(void)waiter;
+	struct snap13_job *job;
+
+	pthread_mutex_lock(&queue_mtx);
+	while (first == NULL && !stop)
+		pthread_cond_wait(&queue_cond, &queue_mtx);
+	job = first;
+	if (job != NULL) {
+		first = job->next;
+		if (first == NULL)
+			last = &first;
 	}
+	pthread_mutex_unlock(&queue_mtx);
 
-	/*
-	 * we can't check here for sure will or will not last file
-	 * contain record with desired lsn since number of rows in file
-	 * is not known beforehand. so, we simply return the last one.
-	 */
-out:
-	say_debug2("%s: target_lsn:%"PRIi64 " file_lsn:%"PRIi64, __func__, target_lsn, *lsn);
-	return [self open_for_read:*lsn];
+	return job != NULL ? &job->request : &snap13_stop;
 }
 
+- (i64)
+perform_request:(request_arg)arg
+{
+	struct snap13_job *job = arg.p;
+
+	snap13_job_run(job);
 
-- (const char *)
-format_filename:(i64)lsn prefix:(const char *)prefix suffix:(const char *)extra_suffix
+	pthread_mutex_lock(job->mtx);
+	job->done = true;
+	pthread_cond_broadcast(job->cond);
+	pthread_mutex_unlock(job->mtx);
+	return 0;
+}
+
+- (id)
+free
 {
-	static char filename[PATH_MAX + 1];
-	snprintf(filename, sizeof(filename),
-		 "%s%s/%020" PRIi64 "%s%s",
-		 prefix, dirname, lsn, suffix, extra_suffix);
-	return filename;
+	thread_requests_finalize(&requests);
+	free(threads);
+	pthread_mutex_destroy(&queue_mtx);
+	pthread_cond_destroy(&queue_cond);
+	return [super free];
 }
+@end
 
-- (const char *)
-format_filename:(i64)lsn suffix:(const char *)extra_suffix
+static void
+buf_swap(char **a, size_t *a_size, char **b, size_t *b_size)
 {
-	return [self format_filename:lsn prefix:"" suffix:extra_suffix];
+	char *buf = *a;
+	size_t size = *a_size;
+	*a = *b;
+	*a_size = *b_size;
+	*b = buf;
+	*b_size = size;
 }
+#endif
 
-- (const char *)
-format_filename:(i64)lsn
+@implementation Snap13
+- (const struct row_v12 *)
+append_row:(struct row_v12 *)row12 data:(const void *)data
 {
-	return [self format_filename:lsn suffix:""];
+	return snap_append_row(self, &io, row12, data);
 }
 
+#ifdef THREADS
+/* with blocks in flight, rows' offsets aren't known: so neither index nor
+   wet rows are supported; snapshots have none of them */
+- (bool)
+jobs_init
+{
+	if (worker != nil)
+		return true;
+	if (cfg.snap_compress_threads <= 0 || index != NULL || (mode == LOG_WRITE && !no_wet))
+		return false;
 
-- (XLog *)
-open_for_read:(i64)lsn
+	pthread_mutex_init(&mtx, NULL);
+	pthread_cond_init(&cond, NULL);
+	job_ring = cfg.snap_compress_threads * 2;
+	job = xcalloc(job_ring, sizeof(*job));
+	for (int i = 0; i < job_ring; i++) {
+		job[i].mtx = &mtx;
+		job[i].cond = &cond;
+	}
+	job_head = job_count = 0;
+	worker = [[Snap13Worker alloc] init_num:cfg.snap_compress_threads];
+	return true;
+}
+
+- (void)
+job_submit
+{
+	struct snap13_job *j = &job[(job_head + job_count) % job_ring];
+	j->done = false;
+	job_count++;
+	[worker push:j];
+}
+
+/* dequeues oldest job, waiting for it to complete */
+- (struct snap13_job *)
+job_wait
+{
+	struct snap13_job *j = &job[job_head];
+	pthread_mutex_lock(&mtx);
+	while (!j->done)
+		pthread_cond_wait(&cond, &mtx);
+	pthread_mutex_unlock(&mtx);
+
+	job_head = (job_head + 1) % job_ring;
+	job_count--;
+	return j;
+}
+
+- (void)
+jobs_cancel
 {
-	const char *filename = [self format_filename:lsn];
-	XLog *xlog = [XLog open_for_read_filename:filename dir:self];
-	if (xlog)
-		xlog->lsn = lsn;
-	return xlog;
+	while (job_count > 0)
+		[self job_wait];
 }
 
-int allow_snap_overwrite = 0;
-- (XLog *)
-open_for_write:(i64)lsn scn:(i64 *)shard_scn_map
+- (int)
+write_job
 {
-        XLog *l = nil;
-        FILE *file = NULL;
-        assert(lsn > 0);
-	char *fbuf = NULL;
+	struct snap13_job *j = [self job_wait];
 
-	const char *final_filename = [self format_filename:lsn];
-	if (!allow_snap_overwrite && access(final_filename, F_OK) == 0) {
-		errno = EEXIST;
-		say_error("failed to create '%s': file already exists", final_filename);
-		goto error;
+	if (fwrite(&block_marker, sizeof(block_marker), 1, fd) != 1 ||
+	    fwrite(&j->h, sizeof(j->h), 1, fd) != 1 ||
+	    fwrite(j->payload, j->h.len, 1, fd) != 1)
+	{
+		say_syserror("fwrite");
+		return -1;
 	}
+	return 0;
+}
 
-	const char *filename = [self format_filename:lsn suffix:inprogress_suffix];
+- (int)
+jobs_drain
+{
+	int ret = 0;
+	while (job_count > 0)
+		if ([self write_job] < 0)
+			ret = -1;
+	return ret;
+}
 
-	/* .inprogress file can't contain confirmed records, overwrite it silently */
-	file = fopen(filename, "w");
-	if (file == NULL) {
-		say_syserror("fopen of %s for writing failed", filename);
-		goto error;
-	}
-	fbuf = set_file_buf(file, 1024 * 1024);
+- (int)
+write_block
+{
+	if (![self jobs_init])
+		return [super write_block];
 
-	l = [[xlog_class alloc] init_filename:filename fd:file dir:self vbuf:fbuf];
+	int ret = 0;
+	if (job_count == job_ring && [self write_job] < 0)
+		ret = -1;
 
-	/* reset local variables: they are included in l */
-	fbuf = NULL;
-	file = NULL;
+	struct snap13_job *j = &job[(job_head + job_count) % job_ring];
+	j->h = (struct xlog13_block){ .rows = wblock_rows,
+				      .raw_len = wblock_len };
+	j->compress = true;
+	buf_swap(&j->in, &j->in_size, &wblock, &wblock_size);
+	[self job_submit];
 
-	l->next_lsn = lsn;
-	l->mode = LOG_WRITE;
-	l->inprogress = 1;
+	wblock_len = 0;
+	wblock_rows = 0;
+	return ret;
+}
 
-	if ([l write_header:shard_scn_map] < 0) {
-		say_syserror("failed to write header");
-		goto error;
+/* makes block of completed job current. on failure following blocks are
+   dropped and -fetch_row rescans file after the failed block's marker */
+- (int)
+take_job
+{
+	struct snap13_job *j = [self job_wait];
+	if (j->ret < 0) {
+		[self jobs_cancel];
+		clearerr(fd);
+		fseeko(fd, j->offset + 1, SEEK_SET);
+		return -1;
 	}
 
-	return l;
-      error:
-        if (file != NULL)
-                fclose(file);
-	free(fbuf);
-        [l free];
-	return NULL;
+	if (j->payload == j->in)
+		buf_swap(&j->in, &j->in_size, &rblock, &rblock_size);
+	else
+		buf_swap(&j->out, &j->out_size, &rblock, &rblock_size);
+	rblock_len = j->h.raw_len;
+	rblock_pos = 0;
+	last_read_offset = j->offset;
+	return 0;
 }
 
-
-static i64
-find(int count, const char *type, i64 needle, i64 *haystack, i64 *lsn)
+/* queue blocks following current one, stop at anything else:
+   eof_marker, partial or damaged block are left to -fetch_row */
+- (void)
+read_ahead
 {
-	haystack += count - 1;
-	lsn += count - 1;
+	while (job_count < job_ring) {
+		struct snap13_job *j = &job[(job_head + job_count) % job_ring];
+		off_t offset = ftello(fd);
+		u32 magic;
 
-	while (count) {
-		if (*haystack < 0) /* error */
-			return -1;
-		/* if *haystack == 0 то вернуть последний файл, потому что мы не знаем заранее ,
-		 есть ли в этом файле нужная запись или нет */
-		if (*haystack <= needle) {
-			say_debug2("%s: %s:%"PRIi64 " file_lsn:%"PRIi64, __func__, type, needle, *lsn);
-			return *lsn;
+		if (fread(&magic, sizeof(magic), 1, fd) != 1 || magic != block_marker ||
+		    xlog13_read_block(fd, &j->h, &j->in, &j->in_size) < 0)
+		{
+			clearerr(fd);
+			fseeko(fd, offset, SEEK_SET);
+			return;
 		}
-
-		haystack--;
-		lsn--;
-		count --;
+		j->offset = offset;
+		j->compress = false;
+		[self job_submit];
 	}
-
-	say_warn("%s: requested %s:%"PRIi64" is missing", __func__, type, needle);
-	return -1;
 }
 
-- (i64 *)
-scan_scn_shard:(int)target_shard_id lsn:(i64 *)lsn count:(int)count
+- (struct row_v12 *)
+read_row
 {
-	i64 *scn = p0alloc(fiber->pool, sizeof(i64) * count);
-
-	/* scn[i] == -1 if error,
-	              0 if not present
-		      b otherwise */
-
-	for (int i = 0; i < count; i++) {
-		const char *filename = [self format_filename:lsn[i]];
-		FILE *file = fopen(filename, "r");
-		if (file == NULL) {
-			say_syserror("fopen of %s for reading failed", filename);
-			scn[i] = -1;
-			continue;
-		}
+	if (![self jobs_init])
+		return [super read_row];
 
-		for (;;) {
-			i64 tmp;
-			int shard_id;
-			char buf[256];
+	assert(job_count == 0);
+	struct snap13_job *j = &job[job_head];
+	if (xlog13_read_block(fd, &j->h, &j->in, &j->in_size) < 0)
+		return NULL;
+	j->offset = last_read_offset;
+	j->compress = false;
+	[self job_submit];
+	[self read_ahead];
 
-			if (fgets(buf, sizeof(buf), file) == NULL) {
-				say_syserror("fgets");
-				scn[i] = -1;
-				break;
-			}
+	if ([self take_job] < 0)
+		return NULL;
 
-			if (strcmp(buf, "\n") == 0 || strcmp(buf, "\r\n") == 0)
-				break;
+	struct row_v12 *row = [self next_block_row];
+	if (row == NULL)
+		[self jobs_cancel];
+	return row;
+}
 
-			if (sscanf(buf, "SCN-%i: %"PRIi64, &shard_id, &tmp) == 2) {
-				if (target_shard_id == shard_id) {
-					scn[i] = tmp;
-					break;
-				}
-			}
-		}
+- (struct row_v12 *)
+fetch_row
+{
+	struct row_v12 *row = [self next_block_row];
+	while (row == NULL && job_count > 0) {
+		if ([self take_job] < 0)
+			break;
+		row = [self next_block_row];
 	}
-	return scn;
+	if (row == NULL)
+		return [super fetch_row];
+
+	++rows;
+	last_read_lsn = row->lsn;
+	return row;
 }
+#endif
 
-- (XLog *)
-find_with_lsn:(i64)lsn
+- (off_t)
+append_offset
 {
-	i64 *dir_lsn;
-	ssize_t count = [self scan_dir:&dir_lsn];
-
-	i64 file_lsn = find(count, "LSN", lsn, dir_lsn, dir_lsn);
-	if (file_lsn <= 0)
-		return nil;
-	return [self open_for_read:file_lsn];
+	if (io.stage_rows > 0 && snap_stage_flush(self, &io) < 0)
+		return -1;
+	if (wblock_rows > 0 && [self write_block] < 0)
+		return -1;
+#ifdef THREADS
+	if ([self jobs_drain] < 0)
+		return -1;
+#endif
+	return ftello(fd);
 }
 
-- (XLog *)
-find_with_scn:(i64)scn shard:(int)shard_id
+- (int)
+flush
 {
-	i64 *dir_lsn, *dir_scn;
-	ssize_t count = [self scan_dir:&dir_lsn];
-	dir_scn = [self scan_scn_shard:shard_id lsn:dir_lsn count:count];
+	if (io.stage_rows > 0 && snap_stage_flush(self, &io) < 0)
+		return -1;
+#ifdef THREADS
+	if ([self jobs_drain] < 0)
+		return -1;
+#endif
+	return [super flush];
+}
 
-	i64 file_lsn = find(count, "SCN", scn, dir_scn, dir_lsn);
-	if (file_lsn <= 0)
-		return nil;
-	return [self open_for_read:file_lsn];
+- (int)
+write_eof_marker
+{
+	if (io.stage_rows > 0 && snap_stage_flush(self, &io) < 0)
+		return -1;
+	if (wblock_rows > 0 && [self write_block] < 0)
+		return -1;
+#ifdef THREADS
+	if ([self jobs_drain] < 0)
+		return -1;
+#endif
+	return [super write_eof_marker];
 }
 
+- (int)
+close
+{
+#ifdef THREADS
+	if (worker != nil) {
+		[self jobs_cancel];
+		[worker close];
+		[worker free];
+		worker = nil;
+		for (int i = 0; i < job_ring; i++) {
+			free(job[i].in);
+			free(job[i].out);
+		}
+		free(job);
+		job = NULL;
+		pthread_mutex_destroy(&mtx);
+		pthread_cond_destroy(&cond);
+	}
+#endif
+	snap_io_free(&io);
+	return [super close];
+}
 @end
 
-@implementation WALDir
-- (XLogDir *)
+@implementation SnapDir
+- (id)
 init_dirname:(const char *)dirname_
 {
         if ((self = [super init_dirname:dirname_])) {
-		filetype = xlog_mark;
-		suffix = ".xlog";
+		filetype = snap_mark;
+		suffix = ".snap";
 	}
-	return self;
+	/* rate limiting and batched checksums */
+	xlog_class = cfg.snap_compress ? [Snap13 class] : [Snap12 class];
+        return self;
 }
-@end
-
-@interface Snap12 : XLog12 {
-	size_t bytes;
-	ev_tstamp step_ts, last_ts;
-}@end
 
-@implementation Snap12
-- (const struct row_v12 *)
-append_row:(struct row_v12 *)row12 data:(const void *)data
+- (const char *)
+format_filename:(i64)lsn part:(int)part
 {
-	const struct row_v12 *ret = [super append_row:row12 data:data];
-	if (ret == NULL)
-		return NULL;
+	char part_suffix[16] = "";
+	if (part >= 0)
+		snprintf(part_suffix, sizeof(part_suffix), ".part%03i", part);
+	return [self format_filename:lsn suffix:part_suffix];
+}
 
-	bytes += sizeof(*row12) + row12->len;
+- (bool)
+has_snap:(i64)lsn part:(int)part
+{
+	return access([self format_filename:lsn part:part], F_OK) == 0;
+}
 
-	if (rows & 31)
-		return ret;
+/* locations of shards of snapshot, see struct snap_ref */
+- (struct snap_ref *)
+load_refs:(i64)lsn count:(u32 *)count
+{
+	return sidecar_load([self format_filename:lsn], refs_suffix, refs_magic,
+			    sizeof(struct snap_ref), count);
+}
 
-	ev_now_update();
-	if (last_ts == 0) {
-		last_ts = ev_now();
-		step_ts = ev_now();
-	}
+- (int)
+store_refs:(const struct snap_ref *)ref count:(u32)count lsn:(i64)lsn
+{
+	return sidecar_store([self format_filename:lsn], refs_suffix, refs_magic,
+			     ref, sizeof(*ref), count);
+}
 
-	const int io_rate_limit = cfg.snap_io_rate_limit * 1024 * 1024;
-	if (io_rate_limit <= 0) {
-		if (ev_now() - step_ts > 0.1) {
-			if ([self flush] < 0)
-				return NULL;
-			if (cfg.snap_fadvise_dont_need)
-				[self fadvise_dont_need];
-			ev_now_update();
-			step_ts = ev_now();
-		}
-		return ret;
-	}
+/* snapshots which kept ones refer to are kept too, see struct snap_ref.
+   Parts and sidecars of removed snapshots are removed with them */
+- (int)
+remove_older:(i64)lsn
+{
+	i64 *dir_lsn, *pinned = NULL;
+	ssize_t count = [self scan_dir:&dir_lsn];
+	u32 pinned_count = 0;
+	int removed = 0;
 
-	if (ev_now() - step_ts > 0.02) {
-		double delta = ev_now() - last_ts;
-		size_t bps = bytes / delta;
+	for (ssize_t i = 0; i < count; i++) {
+		if (dir_lsn[i] < lsn)
+			continue;
 
-		if (bps > io_rate_limit) {
-			if ([self flush] < 0)
-				return NULL;
-			if (cfg.snap_fadvise_dont_need)
-				[self fadvise_dont_need];
-			ev_now_update();
-			delta = ev_now() - last_ts;
-			bps = bytes / delta;
+		u32 n = 0;
+		struct snap_ref *ref = [self load_refs:dir_lsn[i] count:&n];
+		if (ref == NULL) {
+			if (cfg.snap_incremental <= 0)
+				continue;
+			/* its snap_ref rows, if any, are unknown */
+			say_warn("%s: no refs of `%s', nothing removed", __func__,
+				 [self format_filename:dir_lsn[i]]);
+			free(pinned);
+			return 0;
+		}
+		pinned = xrealloc(pinned, (pinned_count + n) * sizeof(*pinned));
+		for (u32 k = 0; k < n; k++)
+			pinned[pinned_count++] = ref[k].lsn;
+		free(ref);
+	}
+
+	for (ssize_t i = 0; i < count && dir_lsn[i] < lsn; i++) {
+		bool pin = false;
+		for (u32 k = 0; k < pinned_count && !pin; k++)
+			pin = pinned[k] == dir_lsn[i];
+		if (pin) {
+			say_info("keeping `%s': newer snapshot refers to it",
+				 [self format_filename:dir_lsn[i]]);
+			continue;
 		}
 
-		if (bps > io_rate_limit) {
-			double sec = delta * (bps - io_rate_limit) / io_rate_limit;
-			usleep(sec * 1e6);
-			ev_now_update();
+		const char *filename = [self format_filename:dir_lsn[i]];
+		if (unlink(filename) < 0) {
+			say_syserror("unlink(%s)", filename);
+			break;
+		}
+		say_info("removed `%s'", filename);
+		for (int part = 0; ; part++) {
+			char part_suffix[16];
+			snprintf(part_suffix, sizeof(part_suffix), ".part%03i", part);
+			if (unlink([self format_filename:dir_lsn[i] suffix:part_suffix]) < 0)
+				break;
 		}
-		step_ts = ev_now();
+		unlink([self format_filename:dir_lsn[i] suffix:refs_suffix]);
+		unlink([self format_filename:dir_lsn[i] suffix:index_suffix]);
+		removed++;
 	}
+	free(pinned);
+	return removed;
+}
 
-	if (ev_now() > last_ts + 1) {
-		bytes = 0;
-		last_ts = step_ts = ev_now();
-	}
+/* keep `keep' newest snapshots (and those they refer to) */
+- (int)
+remove_all_but:(int)keep
+{
+	i64 *dir_lsn;
+	ssize_t count = [self scan_dir:&dir_lsn];
 
-	return ret;
+	if (keep <= 0 || count <= keep)
+		return 0;
+	return [self remove_older:dir_lsn[count - keep]];
 }
 @end
 
 
-@implementation SnapDir
-- (id)
-init_dirname:(const char *)dirname_
+/* offline (re)build of seek index, e.g. for xlogs written without it */
+int
+xlog_index_rebuild(const char *filename)
 {
-        if ((self = [super init_dirname:dirname_])) {
-		filetype = snap_mark;
-		suffix = ".snap";
+	XLog *l;
+	const struct row_v12 *row;
+	int row_count = 0, ret = -1;
+	struct xlog_index *index;
+
+	l = [XLog open_for_read_filename:filename dir:NULL];
+	if (l == nil) {
+		say_syserror("unable to open filename `%s'", filename);
+		return -1;
+	}
+
+	index = xcalloc(1, sizeof(*index));
+	index->step = cfg.wal_index_step > 0 ? cfg.wal_index_step : 1024;
+
+	[l enable_mmap];
+	palloc_register_cut_point(fiber->pool);
+	while ((row = [l fetch_row])) {
+		xlog_index_add(index, row, [l last_read_offset]);
+
+		if (row_count++ > 1024) {
+			palloc_cutoff(fiber->pool);
+			palloc_register_cut_point(fiber->pool);
+			row_count = 0;
+		}
+	}
+	palloc_cutoff(fiber->pool);
+
+	if (![l eof]) {
+		say_error("binary log `%s' wasn't correctly closed", filename);
+	} else if (xlog_index_store(filename, index) == 0) {
+		say_info("%s: %u index entries", filename, index->count);
+		ret = 0;
 	}
-	// rate limiting only v12 snapshots
-	if (xlog_class == [XLog12 class])
-		xlog_class = [Snap12 class];
-        return self;
-}
-@end
 
+	free(index->entry);
+	free(index);
+	[l free];
+	return ret;
+}
 
 static void
 hexdump(struct tbuf *out, u16 tag __attribute__((unused)), struct tbuf *row)
@@ -1923,6 +3922,19 @@ print_row(struct tbuf *buf, const struct row_v12 *row,
 
 		break;
 	}
+	case snap_part: /* rows are in <lsn>.snap.partNNN */
+		tbuf_printf(buf, "part:%03u", read_u32(&row_data));
+		break;
+	case snap_ref: {
+		if (tbuf_len(&row_data) != sizeof(struct snap_ref)) {
+			tbuf_printf(buf, "unknow format");
+			break;
+		}
+		struct snap_ref *ref = read_bytes(&row_data, sizeof(*ref));
+		tbuf_printf(buf, "snap_lsn:%"PRIi64" part:%i offset:%"PRIi64" depth:%i",
+			    ref->lsn, ref->part, ref->offset, ref->depth);
+		break;
+	}
 	case shard_final:
 	case snap_final:
 	case nop:
@@ -0,0 +1,659 @@
+/*
+ * Copyright (C) 2016 Mail.RU
+ * Copyright (C) 2016 Yuriy Vostrikov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* --bench-recovery: generates synthetic snapshot and WALs with real
+   SnapWriter and XLog, then loads them back and reports where the time
+   goes. Output is a single JSON object on stdout, log goes to stderr */
+
+#import <util.h>
+#import <fiber.h>
+#import <log_io.h>
+#import <palloc.h>
+#import <say.h>
+#import <pickle.h>
+#import <tbuf.h>
+#import <assoc.h>
+#import <salloc.h>
+#import <shard.h>
+#import <cfg/defs.h>
+#if OCT_INDEX
+#import <index.h>
+#endif
+
+#include <third_party/crc32.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct bench_spec {
+	const char *dir;
+	u32 rows, wal_rows, wal_file_rows;
+	u32 size_min, size_max;
+	int shards;
+	bool skew, cold;
+	u64 seed;
+} spec;
+
+static struct bench_stage {
+	ev_tstamp generate, io, crc, decode, load, apply, index;
+	u64 bytes, rows, applied;
+	int files;
+} stage;
+
+static inline u64
+bench_rand(u64 *state)
+{
+	u64 x = *state; /* xorshift64* */
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* i-th key of shard: keys are inserted in random order */
+static inline u64
+bench_key(int shard_id, u32 i)
+{
+	u64 x = ((u64)shard_id << 32 | i) + 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* row is u64 key followed by random filler */
+static u32
+bench_row(char *buf, u64 key, u64 *rnd)
+{
+	u32 range = spec.size_max - spec.size_min + 1;
+	u32 len = bench_rand(rnd) % range;
+	if (spec.skew) /* product of two uniform: most rows are small, few are large */
+		len = (u64)len * (bench_rand(rnd) % range) / range;
+	len += spec.size_min;
+
+	memcpy(buf, &key, sizeof(key));
+	for (u32 i = sizeof(key); i < len; i += sizeof(u64)) {
+		u64 r = bench_rand(rnd);
+		memcpy(buf + i, &r, MIN(sizeof(r), len - i));
+	}
+	return len;
+}
+
+
+/* generates rows of shard on snapshot, loads them into hash on recovery
+   and builds tree "secondary index" at the end, like box does */
+@interface BenchExecutor: DefaultExecutor <Executor> {
+@public
+	struct mh_i64_t *h; /* key -> struct tnt_object */
+#if OCT_INDEX
+	Tree *index;
+#endif
+	u32 rows; /* to be written by -snapshot_write_rows: */
+}
+@end
+
+@implementation BenchExecutor
+- (id)
+init
+{
+	[super init];
+	h = mh_i64_init(xrealloc);
+	return self;
+}
+
+- (id)
+free
+{
+	mh_foreach(_i64, h, k)
+		sfree(mh_i64_value(h, k));
+	mh_i64_destroy(h);
+#if OCT_INDEX
+	[index free];
+#endif
+	return [super free];
+}
+
+- (u32)
+snapshot_estimate
+{
+	return rows;
+}
+
+/* may run in snapshot part thread */
+- (int)
+snapshot_write_rows:(XLog *)snap
+{
+	char *buf = xmalloc(spec.size_max);
+	u64 rnd = spec.seed + shard->id + 1;
+	int ret = 0;
+
+	for (u32 i = 0; i < rows; i++) {
+		u32 len = bench_row(buf, bench_key(shard->id, i), &rnd);
+		if ([snap append_row:buf len:len shard:shard tag:snap_data|TAG_SNAP] == NULL) {
+			ret = -1;
+			break;
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+- (void)
+apply:(struct tbuf *)data tag:(u16)tag
+{
+	(void)tag;
+	ev_tstamp start = ev_time();
+	u32 len = tbuf_len(data);
+	u64 key;
+
+	if (len < sizeof(key))
+		raise_fmt("row is too short");
+	memcpy(&key, data->ptr, sizeof(key));
+
+	struct tnt_object *obj = salloc(sizeof(*obj) + len);
+	void *old = NULL;
+	if (obj == NULL)
+		raise_fmt("can't allocate %u bytes", len);
+	obj->type = 0;
+	obj->flags = 0;
+	memcpy(obj->data, data->ptr, len);
+	if (!mh_i64_put(h, key, obj, &old))
+		sfree(old);
+
+	stage.applied++;
+	stage.apply += ev_time() - start;
+}
+
+#if OCT_INDEX
+static struct index_node *
+bench_dtor(struct tnt_object *obj, struct index_node *node, void *arg __attribute__((unused)))
+{
+	node->obj = obj;
+	memcpy(&node->key.u64, obj->data, sizeof(u64));
+	return node;
+}
+
+static struct dtor_conf bench_dtor_conf = { .u64 = bench_dtor };
+static struct index_conf bench_index_conf = {
+	.min_tuple_cardinality = 1,
+	.cardinality = 1,
+	.type = FASTTREE,
+	.unique = true,
+	.field = { { .offset = 0, .index = 0, .sort_order = ASC, .type = UNUM64 } }
+};
+#endif
+
+/* bulk build of tree index from all rows, the way box does it after snapshot load */
+- (void)
+wal_final_row
+{
+#if OCT_INDEX
+	ev_tstamp start = ev_time();
+	size_t count = 0;
+
+	[index free];
+	index = [Index new_conf:&bench_index_conf dtor:&bench_dtor_conf];
+	void *nodes = xmalloc((mh_size(h) ?: 1) * index->node_size);
+	mh_foreach(_i64, h, k) {
+		index->dtor(mh_i64_value(h, k), nodes + count * index->node_size, index->dtor_arg);
+		count++;
+	}
+	if (count == 0) {
+		free(nodes);
+		nodes = NULL;
+	}
+	[index sort_nodes:nodes count:count onduplicate:NULL arg:NULL];
+	[index set_sorted_nodes:nodes count:count]; /* takes nodes */
+
+	stage.index += ev_time() - start;
+#else
+	static bool warned;
+	if (!warned)
+		say_warn("built without index, index stage is skipped");
+	warned = true;
+#endif
+}
+@end
+
+
+/* just enough of RecoveryState for SnapWriter */
+@interface BenchState: Object <RecoveryState> {
+@public
+	Shard<Shard> *shard[MAX_SHARD];
+}
+@end
+
+@implementation BenchState
+- (i64)
+lsn
+{
+	return 1;
+}
+
+- (Shard<Shard> *)
+shard:(unsigned)shard_id
+{
+	return shard[shard_id];
+}
+@end
+
+
+static int
+bench_parse(const char *text)
+{
+	char *copy = strdup(text), *save = NULL; /* spec.dir points into it */
+
+	spec = (struct bench_spec){ .dir = "bench_recovery",
+				    .rows = 1000000,
+				    .wal_rows = 100000,
+				    .wal_file_rows = cfg.rows_per_wal,
+				    .size_min = 32,
+				    .size_max = 256,
+				    .shards = 1,
+				    .seed = 1 };
+
+	for (char *key = strtok_r(copy, ",", &save); key; key = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(key, '=');
+		if (val == NULL)
+			goto bad;
+		*val++ = 0;
+
+		if (strcmp(key, "dir") == 0)
+			spec.dir = val;
+		else if (strcmp(key, "rows") == 0)
+			spec.rows = strtoul(val, NULL, 10);
+		else if (strcmp(key, "wal_rows") == 0)
+			spec.wal_rows = strtoul(val, NULL, 10);
+		else if (strcmp(key, "wal_file_rows") == 0)
+			spec.wal_file_rows = strtoul(val, NULL, 10);
+		else if (strcmp(key, "shards") == 0)
+			spec.shards = atoi(val);
+		else if (strcmp(key, "seed") == 0)
+			spec.seed = strtoull(val, NULL, 10);
+		else if (strcmp(key, "cold") == 0)
+			spec.cold = atoi(val) != 0;
+		else if (strcmp(key, "size") == 0) {
+			int n = sscanf(val, "%u-%u", &spec.size_min, &spec.size_max);
+			if (n == 1)
+				spec.size_max = spec.size_min;
+			else if (n != 2)
+				goto bad;
+		} else if (strcmp(key, "dist") == 0) {
+			if (strcmp(val, "uniform") == 0)
+				spec.skew = false;
+			else if (strcmp(val, "skew") == 0)
+				spec.skew = true;
+			else
+				goto bad;
+		} else {
+			goto bad;
+		}
+	}
+
+	if (spec.shards < 1 || spec.shards > MAX_SHARD) {
+		say_error("shards must be in 1..%i", MAX_SHARD);
+		return -1;
+	}
+	if (spec.size_min < sizeof(u64) || spec.size_max < spec.size_min) {
+		say_error("bad row size %u-%u, minimum is %zu", spec.size_min, spec.size_max, sizeof(u64));
+		return -1;
+	}
+	if (spec.wal_file_rows == 0)
+		spec.wal_file_rows = 500000;
+	return 0;
+bad:
+	say_error("bad bench spec near `%s', expected: "
+		  "dir=PATH,rows=N,size=MIN-MAX,dist=uniform|skew,shards=N,"
+		  "wal_rows=N,wal_file_rows=N,cold=0|1,seed=N", text);
+	return -1;
+}
+
+static int
+bench_generate()
+{
+	static i64 scn[MAX_SHARD];
+	BenchState *state = [[BenchState alloc] init];
+	SnapWriter *writer = nil;
+	struct shard_op sop = { .ver = 0, .type = SHARD_TYPE_POR };
+	XLog *wal = nil;
+	char *buf = NULL;
+	u64 rnd = spec.seed;
+	i64 lsn = 1;
+	u32 wet = 0;
+	int ret = -1;
+
+	strncpy(sop.mod_name, [BenchExecutor name], sizeof(sop.mod_name));
+	strncpy(sop.peer[0], cfg.hostname, sizeof(sop.peer[0]));
+
+	for (int i = 0; i < spec.shards; i++) {
+		BenchExecutor *exec = [[BenchExecutor alloc] init];
+		exec->rows = spec.rows / spec.shards + (i < spec.rows % spec.shards);
+		state->shard[i] = [[POR alloc] init_id:i scn:1 sop:&sop];
+		[state->shard[i] set_executor:exec];
+		scn[i] = 2; /* WAL header: SCN of the next row of each shard */
+	}
+
+	say_info("generating snapshot: %u rows in %i shards", spec.rows, spec.shards);
+	writer = [[SnapWriter alloc] init_state:state];
+	if ([writer snapshot_write] < 0) {
+		say_error("can't write snapshot");
+		goto out;
+	}
+
+	/* updates of random existing rows, written and rotated like WALDiskWriter does */
+	say_info("generating WALs: %u rows, %u rows per WAL", spec.wal_rows, spec.wal_file_rows);
+	buf = xmalloc(spec.size_max);
+	for (u32 n = 0; n < spec.wal_rows; n++) {
+		if (wal == nil) {
+			wal = [wal_dir open_for_write:lsn + 1 scn:scn];
+			if (wal == nil) {
+				say_syserror("can't open wal");
+				goto out;
+			}
+		}
+
+		int shard_id = bench_rand(&rnd) % spec.shards;
+		BenchExecutor *exec = (id)[state->shard[shard_id] executor];
+		u32 i = exec->rows ? bench_rand(&rnd) % exec->rows : 0;
+		struct row_v12 row = { .scn = scn[shard_id]++,
+				       .tm = ev_time(),
+				       .tag = wal_data|TAG_WAL,
+				       .shard_id = shard_id };
+		row.len = bench_row(buf, bench_key(shard_id, i), &rnd);
+		if ([wal append_row:&row data:buf] == NULL) {
+			say_syserror("can't write wal row");
+			goto out;
+		}
+
+		if (++wet == 1024 || n + 1 == spec.wal_rows ||
+		    [wal rows] + wet >= spec.wal_file_rows)
+		{
+			lsn = [wal confirm_write];
+			wet = 0;
+			if (wal->inprogress && [wal rows] > 0 && [wal inprogress_rename] != 0) {
+				say_syserror("can't rename wal");
+				goto out;
+			}
+			if ([wal rows] >= spec.wal_file_rows) {
+				[wal free];
+				wal = nil;
+			}
+		}
+	}
+	ret = 0;
+out:
+	[wal free];
+	free(buf);
+	for (int i = 0; i < spec.shards; i++)
+		[state->shard[i] release];
+	[writer free];
+	[state free];
+	return ret;
+}
+
+/* snapshot, its parts and WALs, but not .idx/.refs sidecars */
+static bool
+bench_file(const char *name)
+{
+	const char *dot = strchr(name, '.');
+	if (dot == NULL)
+		return false;
+	return strcmp(dot, ".snap") == 0 || strcmp(dot, ".xlog") == 0 ||
+	       (strncmp(dot, ".snap.part", 10) == 0 && strlen(dot) == strlen(".snap.part000"));
+}
+
+static int
+bench_cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+static char **
+bench_files(int *count)
+{
+	DIR *dh = opendir(spec.dir);
+	struct dirent *dent;
+	char **file = NULL;
+	int n = 0, size = 0;
+
+	if (dh == NULL) {
+		say_syserror("opendir(%s)", spec.dir);
+		return NULL;
+	}
+	while ((dent = readdir(dh))) {
+		if (!bench_file(dent->d_name))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 16;
+			file = xrealloc(file, size * sizeof(*file));
+		}
+		file[n] = xmalloc(strlen(spec.dir) + strlen(dent->d_name) + 2);
+		sprintf(file[n++], "%s/%s", spec.dir, dent->d_name);
+	}
+	closedir(dh);
+	qsort(file, n, sizeof(*file), bench_cmp_name);
+	*count = n;
+	return file;
+}
+
+/* evict files from page cache, so next pass reads them from disk */
+static void
+bench_drop_cache(char **file, int count)
+{
+#if HAVE_POSIX_FADVISE
+	for (int i = 0; i < count; i++) {
+		int fd = open(file[i], O_RDONLY);
+		if (fd < 0) {
+			say_syserror("open(%s)", file[i]);
+			continue;
+		}
+		fsync(fd); /* dirty pages aren't dropped */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#else
+	(void)file;
+	(void)count;
+	say_warn("no posix_fadvise, cold=1 is no op");
+#endif
+}
+
+/* raw read and crc32c of every byte: lower bound of recovery */
+static int
+bench_read(char **file, int count)
+{
+	const size_t chunk = 1024 * 1024;
+	char *buf = xmalloc(chunk);
+	u32 crc = 0;
+	int ret = 0;
+
+	for (int i = 0; i < count && ret == 0; i++) {
+		int fd = open(file[i], O_RDONLY);
+		if (fd < 0) {
+			say_syserror("open(%s)", file[i]);
+			ret = -1;
+			break;
+		}
+		for (;;) {
+			ev_tstamp start = ev_time();
+			ssize_t r = read(fd, buf, chunk);
+			stage.io += ev_time() - start;
+			if (r < 0) {
+				say_syserror("read(%s)", file[i]);
+				ret = -1;
+			}
+			if (r <= 0)
+				break;
+
+			start = ev_time();
+			crc = crc32c(crc, (unsigned char *)buf, r);
+			stage.crc += ev_time() - start;
+			stage.bytes += r;
+		}
+		close(fd);
+	}
+	say_debug("%s: crc32c:0x%08x", __func__, crc);
+	free(buf);
+	return ret;
+}
+
+/* [fetch_row] of every file already in page cache, i.e. decoding alone:
+   row framing, row crc check and decompression */
+static int
+bench_decode(char **file, int count)
+{
+	for (int i = 0; i < count; i++) {
+		XLog *l = [XLog open_for_read_filename:file[i] dir:NULL];
+		if (l == nil) {
+			say_syserror("unable to open filename `%s'", file[i]);
+			return -1;
+		}
+
+		[l enable_mmap];
+		ev_tstamp start = ev_time();
+		u32 row_count = 0;
+		palloc_register_cut_point(fiber->pool);
+		while ([l fetch_row]) {
+			if ((++row_count & 0x3ff) == 0) {
+				palloc_cutoff(fiber->pool);
+				palloc_register_cut_point(fiber->pool);
+			}
+		}
+		palloc_cutoff(fiber->pool);
+		stage.decode += ev_time() - start;
+		stage.rows += row_count;
+
+		bool eof = [l eof];
+		[l free];
+		if (!eof) {
+			say_error("`%s' wasn't correctly closed", file[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* real load: XLogReader, Recovery and shards, executors are BenchExecutor */
+static int
+bench_load()
+{
+	XLogReader *reader = nil;
+
+	@try {
+		recovery = [[Recovery alloc] init];
+		reader = [[XLogReader alloc] init_recovery:recovery];
+
+		ev_tstamp start = ev_time();
+		i64 lsn = [reader load_full:nil];
+		stage.load = ev_time() - start;
+		say_info("loaded LSN:%"PRIi64, lsn);
+
+		for (int i = 0; i < MAX_SHARD; i++) {
+			Shard<Shard> *shard = [recovery shard:i];
+			if (shard && [(id)[shard executor] isKindOf:[BenchExecutor class]])
+				[[shard executor] wal_final_row];
+		}
+	}
+	@catch (Error *e) {
+		say_error("recovery failed: %s", e->reason);
+		return -1;
+	}
+	@finally {
+		[reader free];
+	}
+	return 0;
+}
+
+int
+recovery_bench(const char *text)
+{
+	char **file = NULL;
+	int ret = -1;
+
+	if (bench_parse(text) < 0)
+		return -1;
+	if (cfg.hostname == NULL)
+		cfg.hostname = strdup("bench");
+
+	if (mkdir(spec.dir, 0755) < 0 && errno != EEXIST) {
+		say_syserror("mkdir(%s)", spec.dir);
+		return -1;
+	}
+	snap_dir = [[SnapDir alloc] init_dirname:strdup(spec.dir)];
+	wal_dir = [[WALDir alloc] init_dirname:strdup(spec.dir)];
+	wal_stream_dir[0] = wal_dir;
+	if ([snap_dir greatest_lsn] != 0 || [wal_dir greatest_lsn] != 0) {
+		say_error("`%s' isn't empty", spec.dir);
+		return -1;
+	}
+
+	ev_tstamp start = ev_time();
+	if (bench_generate() < 0)
+		goto out;
+	stage.generate = ev_time() - start;
+
+	if ((file = bench_files(&stage.files)) == NULL)
+		goto out;
+
+	if (spec.cold)
+		bench_drop_cache(file, stage.files);
+	if (bench_read(file, stage.files) < 0)
+		goto out;
+	if (bench_decode(file, stage.files) < 0)
+		goto out;
+	if (spec.cold)
+		bench_drop_cache(file, stage.files);
+	if (bench_load() < 0)
+		goto out;
+
+	ev_tstamp total = stage.load + stage.index;
+	printf("{\"dir\":\"%s\",\"rows\":%u,\"wal_rows\":%u,\"wal_file_rows\":%u,"
+	       "\"shards\":%i,\"size_min\":%u,\"size_max\":%u,\"dist\":\"%s\",\"cold\":%s,"
+	       "\"files\":%i,\"bytes\":%"PRIu64",\"rows_read\":%"PRIu64",\"rows_applied\":%"PRIu64","
+	       "\"generate\":%.6f,\"load_full\":%.6f,\"total\":%.6f,\"rows_per_sec\":%.0f,"
+	       "\"stages\":{\"io\":%.6f,\"crc\":%.6f,\"decode\":%.6f,\"apply\":%.6f,\"index\":%.6f}}\n",
+	       spec.dir, spec.rows, spec.wal_rows, spec.wal_file_rows,
+	       spec.shards, spec.size_min, spec.size_max, spec.skew ? "skew" : "uniform",
+	       spec.cold ? "true" : "false",
+	       stage.files, stage.bytes, stage.rows, stage.applied,
+	       stage.generate, stage.load, total, total > 0 ? stage.applied / total : 0.,
+	       stage.io, stage.crc, stage.decode, stage.apply, stage.index);
+	fflush(stdout);
+	ret = 0;
+out:
+	for (int i = 0; file && i < stage.files; i++)
+		free(file[i]);
+	free(file);
+	return ret;
+}
+
+register_source();
@@ -173,6 +173,12 @@ partial_replica_load(va_list ap)
 
 - (int)
 submit:(const void *)data len:(u32)len tag:(u16)tag
+{
+	return [self submit:data len:len tag:tag durability:WAL_DURABILITY_DEFAULT];
+}
+
+- (int)
+submit:(const void *)data len:(u32)len tag:(u16)tag durability:(enum wal_durability)durability
 {
 	static unsigned count;
 	static struct msg_void_ptr msg;
@@ -187,12 +193,22 @@ submit:(const void *)data len:(u32)len tag:(u16)tag
 		return 0;
 	}
 
+	/* POR shard has no replicas to wait for */
+	if (durability == WAL_DURABILITY_REPLICATED) {
+		say_warn("REPLICATED durability is not supported by POR shard");
+		return 0;
+	}
+
 	if (++count % 32 == 0 && msg.link.tqe_prev == NULL)
 	 	mbox_put(&recovery->run_crc_mbox, &msg, link);
 
-	struct wal_reply *reply = [recovery->writer submit:data len:len tag:tag shard_id:self->id];
+	struct wal_reply *reply = [[recovery shard_writer:self->id] submit:data len:len tag:tag
+								  shard_id:self->id
+								durability:durability];
 	if (reply->row_count) {
-		scn = reply->scn;
+		/* writer keeps replies of shard in order, never step scn back anyway */
+		if (reply->scn > scn)
+			scn = reply->scn;
 		[self update_run_crc:reply];
 	}
 	return reply->row_count;
@@ -251,7 +267,7 @@ recover_row:(struct row_v12 *)row
 
 		// calculate run_crc _before_ calling executor: it may change row
 		if (scn_changer(row->tag))
-			run_crc_calc(&run_crc_log, row->tag, row->data, row->len);
+			run_crc_calc(&run_crc_log, row);
 	}
 
 	switch (row->tag & TAG_MASK) {
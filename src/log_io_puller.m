@@ -310,6 +310,7 @@ replication_handshake:(void*)hshake len:(size_t)hsize
 handshake:(i64)scn
 {
 	assert(scn >= 0);
+	verified_len = 0;
 
 	if ([self establish_connection] < 0)
 		goto err;
@@ -363,6 +364,31 @@ contains_full_row_v12(const struct tbuf *b)
 		tbuf_len(b) >= sizeof(struct row_v12) + row_v12(b)->len;
 }
 
+/* check data crc of all complete rows in buffer at once:
+   crc32c_multi() hashes independent rows in parallel */
+static size_t
+verify_rows_v12(const struct tbuf *b)
+{
+	struct row_v12 *rows[64];
+	const char *p = b->ptr;
+	size_t len = tbuf_len(b);
+	int n = 0;
+
+	while (n < nelem(rows) &&
+	       len >= sizeof(struct row_v12) &&
+	       len >= sizeof(struct row_v12) + ((struct row_v12 *)p)->len)
+	{
+		size_t row_len = sizeof(struct row_v12) + ((struct row_v12 *)p)->len;
+		rows[n++] = (struct row_v12 *)p;
+		p += row_len;
+		len -= row_len;
+	}
+
+	if (row_v12_verify(rows, n, false) != n)
+		raise_fmt("data crc32c mismatch");
+	return p - (const char *)b->ptr;
+}
+
 static bool
 contains_full_row_v11(const struct tbuf *b)
 {
@@ -451,11 +477,11 @@ fetch_row
 		if (!contains_full_row_v12(&rbuf))
 			return NULL;
 
-		buf = tbuf_split(&rbuf, sizeof(struct row_v12) + row_v12(&rbuf)->len);
+		if (verified_len == 0)
+			verified_len = verify_rows_v12(&rbuf);
 
-		data_crc = crc32c(0, row_v12(buf)->data, row_v12(buf)->len);
-		if (row_v12(buf)->data_crc32c != data_crc)
-			raise_fmt("data crc32c mismatch");
+		buf = tbuf_split(&rbuf, sizeof(struct row_v12) + row_v12(&rbuf)->len);
+		verified_len -= tbuf_len(buf);
 
 		fixup_row_v12(row_v12(buf));
 		break;
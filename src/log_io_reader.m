@@ -30,21 +30,197 @@
 #import <fiber.h>
 #import <log_io.h>
 #import <pickle.h>
+#import <stat.h>
+
+#include <stdint.h>
+#include <unistd.h>
+#if HAVE_INOTIFY_INIT && HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+#ifdef THREADS
+#import <thread_pool.h>
+
+/* XLogPrefetcher: reads, verifies and frames rows of mmap'ed xlog in a
+   separate thread, so [recovery recover_row:] runs concurrently with I/O
+   and crc32c. Rows are passed through SPSC ring of pointers into the
+   mapping; NULL marks the end of stream. Only slow path (ring is full or
+   empty) takes the mutex */
+#define PREFETCH_RING_SIZE 4096
+
+@interface XLogPrefetcher: ThreadWorker {
+	struct row_v12 *ring[PREFETCH_RING_SIZE];
+	u32 head, tail; /* head is written by producer, tail by consumer */
+	int producer_waits, consumer_waits, stop;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	XLog *stream;
+}
+- (bool) busy;
+- (void) start:(XLog *)stream;
+- (struct row_v12 *) fetch_row;
+- (void) finish;
+@end
+
+@implementation XLogPrefetcher
+- (id)
+init
+{
+	pthread_mutex_init(&mtx, NULL);
+	pthread_cond_init(&cond, NULL);
+	return [super init_num:1];
+}
+
+static void
+prefetch_wait(XLogPrefetcher *self, int *waits, bool (*ready)(XLogPrefetcher *))
+{
+	pthread_mutex_lock(&self->mtx);
+	__atomic_store_n(waits, 1, __ATOMIC_SEQ_CST);
+	while (!ready(self))
+		pthread_cond_wait(&self->cond, &self->mtx);
+	__atomic_store_n(waits, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&self->mtx);
+}
+
+static void
+prefetch_wake(XLogPrefetcher *self, int *waits)
+{
+	if (__atomic_load_n(waits, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&self->mtx);
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->mtx);
+}
+
+static bool
+has_space(XLogPrefetcher *self)
+{
+	return __atomic_load_n(&self->head, __ATOMIC_SEQ_CST) -
+	       __atomic_load_n(&self->tail, __ATOMIC_SEQ_CST) < PREFETCH_RING_SIZE;
+}
+
+static bool
+has_rows(XLogPrefetcher *self)
+{
+	return __atomic_load_n(&self->head, __ATOMIC_SEQ_CST) !=
+	       __atomic_load_n(&self->tail, __ATOMIC_SEQ_CST);
+}
+
+- (void)
+thread_loop:(thread_pool_waiter *)waiter
+{
+	for (;;) {
+		thread_pool_request *request = [self pop_request:waiter];
+		if (request->req.cb == NULL)
+			return;
+		free(request);
+
+		struct row_v12 *row;
+		do {
+			row = __atomic_load_n(&stop, __ATOMIC_SEQ_CST) ? NULL : [stream fetch_row];
+			if (!has_space(self))
+				prefetch_wait(self, &producer_waits, has_space);
+			ring[head % PREFETCH_RING_SIZE] = row;
+			__atomic_store_n(&head, head + 1, __ATOMIC_SEQ_CST);
+			prefetch_wake(self, &consumer_waits);
+		} while (row != NULL);
+	}
+}
+
+- (bool)
+busy
+{
+	return stream != nil;
+}
+
+- (void)
+start:(XLog *)stream_
+{
+	assert(stream == nil);
+	stream = stream_;
+	head = tail = 0;
+	stop = 0;
+	[self send:(request_arg){ .p = stream }];
+}
+
+- (struct row_v12 *)
+fetch_row
+{
+	if (stream == nil)
+		return NULL;
+
+	if (!has_rows(self))
+		prefetch_wait(self, &consumer_waits, has_rows);
+
+	struct row_v12 *row = ring[tail % PREFETCH_RING_SIZE];
+	__atomic_store_n(&tail, tail + 1, __ATOMIC_SEQ_CST);
+	prefetch_wake(self, &producer_waits);
+
+	if (row == NULL)
+		stream = nil; /* producer is done with stream */
+	else
+		[stream mmap_release:row];
+	return row;
+}
+
+/* wait till producer leaves stream, e.g. on exception.
+   consumer drains the ring, so producer never blocks forever */
+- (void)
+finish
+{
+	__atomic_store_n(&stop, 1, __ATOMIC_SEQ_CST);
+	prefetch_wake(self, &producer_waits);
+	while ([self fetch_row] != NULL);
+}
+@end
+
+static XLogPrefetcher *prefetcher;
+#endif
+
+/* rows of complete files are read by mmap, and, if possible,
+   by prefetch thread. returns object to [fetch_row] from */
+static id
+row_source(XLog *stream)
+{
+#ifdef THREADS
+	if (cfg.wal_reader_thread && sizeof(void *) == 8) {
+		if (prefetcher == nil)
+			prefetcher = [[XLogPrefetcher alloc] init];
+		/* whole file is mapped: prefetcher may run far ahead */
+		if (![prefetcher busy] && [stream enable_mmap:SIZE_MAX] == 0) {
+			[prefetcher start:stream];
+			return prefetcher;
+		}
+	}
+#endif
+	[stream enable_mmap];
+	return stream;
+}
 
 @implementation XLogReader
 - (i64) lsn { return lsn; }
+- (void) set_background:(bool)flag { background = flag; }
+- (ev_tstamp) lag { return lag; }
 
 - (id)
-init_recovery:(id<RecoverRow>)recovery_
+init_recovery:(id<RecoverRow>)recovery_ dir:(XLogDir *)dir_
 {
 	recovery = recovery_;
+	dir = dir_;
 	wal_timer.data = self;
 	return self;
 }
 
+- (id)
+init_recovery:(id<RecoverRow>)recovery_
+{
+	return [self init_recovery:recovery_ dir:wal_dir];
+}
+
 - (void)
 recover_row_stream:(XLog *)stream
 {
+	id src = stream;
 	@try {
 		unsigned row_count = 0;
 		unsigned estimated_snap_rows = 0;
@@ -52,40 +228,57 @@ recover_row_stream:(XLog *)stream
 		palloc_register_cut_point(fiber->pool);
 
 		if (stream->dir == snap_dir) {
-			row = [stream fetch_row];
+			src = row_source(stream);
+			row = [src fetch_row];
 			if (row && (row->tag & TAG_MASK) == snap_initial) {
 				struct tbuf row_data = TBUF(row->data, row->len, NULL);
 				if (row->len == sizeof(u32) * 3) { /* not a dummy row */
 					estimated_snap_rows = read_u32(&row_data);
 					(void)read_u32(&row_data);
 					(void)read_u32(&row_data); /* ignore run_crc_mod */
-				}
-				if (row->len > sizeof(u32) * 3) {
+				} else if (row->len >= sizeof(u8) + sizeof(u32) * 2) {
 					int ver = read_u8(&row_data);
-					if (ver == 0)
+					if (ver == 0) {
 						estimated_snap_rows = read_u32(&row_data);
-					else
+						u32 flags = read_u32(&row_data);
+						if (flags & SNAP_F_PARTS) {
+							[self recover_snap_parts:src lsn:stream->lsn];
+							return;
+						}
+					} else {
 						say_warn("unknown snap_initial format");
+					}
 				}
 			}
 		} else {
-			while ((row = [stream fetch_row]))
+			/* skip to the nearest indexed row, if any */
+			[stream seek_lsn:lsn + 1];
+			src = row_source(stream);
+			while ((row = [src fetch_row]))
 				if (row->lsn > lsn)
 					break;
 		}
 
-		for (; row; row = [stream fetch_row]) {
+		for (; row; row = [src fetch_row]) {
+			if (row->tag == (snap_ref|TAG_SYS)) {
+				[self recover_snap_ref:row];
+				continue;
+			}
+
 			[recovery recover_row:row];
 
 			if (unlikely(row->lsn - lsn > 1 && cfg.panic_on_lsn_gap))
 				panic("LSN sequence has gap after %"PRIi64 " -> %"PRIi64, lsn, row->lsn);
 			lsn = row->lsn;
+			row_tm = row->tm;
 
 			row_count++;
 
 			if ((row_count & 0x1ff) == 0x1ff) {
 				palloc_cutoff(fiber->pool);
 				palloc_register_cut_point(fiber->pool);
+				if (background)
+					fiber_sleep(0);
 			}
 
 			if ((row_count & 0x1ffff) == 0x1ffff) {
@@ -93,7 +286,8 @@ recover_row_stream:(XLog *)stream
 					float pct = 100. * row_count / estimated_snap_rows;
 					say_info("%.1fM/%.2f%% rows recovered",
 						 row_count / 1000000., pct);
-					title("loading %.2f%%", pct);
+					if (!background)
+						title("loading %.2f%%", pct);
 				} else {
 					say_info("%.1fM rows recovered", row_count / 1000000.);
 				}
@@ -101,11 +295,112 @@ recover_row_stream:(XLog *)stream
 		}
 	}
 	@finally {
+#ifdef THREADS
+		if (src == prefetcher)
+			[prefetcher finish];
+#endif
 		palloc_cutoff(fiber->pool);
 	}
 }
 
 
+/* manifest lists parts of snapshot, each part is complete snapshot
+   of some shards. Parts are loaded one by one: executors aren't thread
+   safe, but reading and crc checking of every part is done by prefetch
+   thread (see row_source()), and next part is read ahead by kernel. */
+- (void)
+recover_snap_parts:(id)manifest lsn:(i64)snap_lsn
+{
+	struct row_v12 *row;
+	int parts = 0, *part = NULL;
+
+	while ((row = [manifest fetch_row])) {
+		if ((row->tag & TAG_MASK) != snap_part)
+			continue;
+		part = xrealloc(part, (parts + 1) * sizeof(*part));
+		part[parts++] = *(u32 *)row->data;
+	}
+
+	@try {
+		XLog *next = parts > 0 ? [snap_dir open_for_read:snap_lsn part:part[0]] : nil;
+		for (int i = 0; i < parts; i++) {
+			XLog *snap = next;
+			if (snap == nil)
+				raise_fmt("can't find/open snapshot part %i", part[i]);
+
+			next = i + 1 < parts ? [snap_dir open_for_read:snap_lsn part:part[i + 1]] : nil;
+			[next fadvise_will_need];
+			@try {
+				say_info("recover from `%s'", snap->filename);
+				[self recover_row_stream:snap];
+				if (![snap eof])
+					raise_fmt("unable to fully read snapshot part");
+			}
+			@finally {
+				[snap free];
+			}
+		}
+	}
+	@finally {
+		free(part);
+	}
+	lsn = snap_lsn;
+}
+
+/* rows of shard unchanged since older snapshot are read from there,
+   see struct snap_ref. They're recovered as rows of current snapshot */
+- (void)
+recover_snap_ref:(const struct row_v12 *)ref_row
+{
+	struct snap_ref ref;
+
+	if (ref_row->len != sizeof(ref))
+		raise_fmt("bad snap_ref row");
+	memcpy(&ref, ref_row->data, sizeof(ref));
+
+	XLog *snap = ref.part < 0 ? [snap_dir open_for_read:ref.lsn] :
+				    [snap_dir open_for_read:ref.lsn part:ref.part];
+	if (snap == nil)
+		raise_fmt("can't find/open snapshot LSN:%"PRIi64" with rows of shard %i",
+			  ref.lsn, ref.shard_id);
+
+	say_debug("shard %i: recover from `%s'", ref.shard_id, snap->filename);
+	palloc_register_cut_point(fiber->pool);
+	@try {
+		struct row_v12 *row;
+		unsigned row_count = 0;
+
+		if ([snap seek_offset:ref.offset] < 0)
+			raise_fmt("can't seek to shard %i in `%s'", ref.shard_id, snap->filename);
+
+		while ((row = [snap fetch_row])) {
+			if (row->shard_id != ref.shard_id)
+				raise_fmt("unexpected row of shard %i in `%s'",
+					  row->shard_id, snap->filename);
+
+			row->lsn = ref_row->lsn;
+			[recovery recover_row:row];
+
+			if ((row->tag & TAG_MASK) == shard_final) {
+				if (row->scn != ref.scn)
+					raise_fmt("shard %i SCN mismatch in `%s'",
+						  ref.shard_id, snap->filename);
+				return;
+			}
+
+			if ((++row_count & 0x1ff) == 0) {
+				palloc_cutoff(fiber->pool);
+				palloc_register_cut_point(fiber->pool);
+			}
+		}
+		raise_fmt("shard %i is truncated in `%s'", ref.shard_id, snap->filename);
+	}
+	@finally {
+		palloc_cutoff(fiber->pool);
+		[snap free];
+	}
+}
+
 - (i64)
 recover_snap:(XLog *)snap
 {
@@ -174,14 +469,24 @@ close_current_wal
 	current_wal = nil;
 }
 
+/* next WALs are read from disk by kernel while current one is applied */
+- (void)
+readahead_wals
+{
+	if (cfg.wal_readahead > 0 && current_wal != nil)
+		[dir readahead:cfg.wal_readahead after:current_wal->lsn done:&readahead_lsn];
+}
+
 - (XLog *)
 open_next_wal
 {
 	[self close_current_wal];
 
-	current_wal = [wal_dir open_for_read:lsn + 1];
-	if (current_wal != nil)
+	current_wal = [dir open_for_read:lsn + 1];
+	if (current_wal != nil) {
 		say_info("recover from `%s'", current_wal->filename);
+		[self readahead_wals];
+	}
 	return current_wal;
 }
 
@@ -193,13 +498,14 @@ recover_remaining_wals
 {
 	assert(lsn > 0);
 	say_debug("%s: LSN:%"PRIi64, __func__, lsn);
-	i64 wal_greatest_lsn = [wal_dir greatest_lsn];
+	i64 wal_greatest_lsn = [dir greatest_lsn];
 	if (wal_greatest_lsn == -1)
-		raise_fmt("wal_dir reading failed");
+		raise_fmt("%s reading failed", dir->dirname);
 
 	/* if the caller already opened WAL for us, recover from it first */
 	if (current_wal != nil) {
 		say_debug("%s: current_wal:%s", __func__, current_wal->filename);
+		[self readahead_wals];
 		[self recover_row_stream:current_wal];
 	}
 
@@ -222,16 +528,16 @@ recover_remaining_wals
 - (i64)
 load_full:(XLog *)preferred_snap
 {
-	if ([wal_dir greatest_lsn] == 0 && [snap_dir greatest_lsn] == 0) {
+	if ([dir greatest_lsn] == 0 && [snap_dir greatest_lsn] == 0) {
 		say_info("local state is empty: no snapshot and xlog found");
 		return 0;
 	}
 
 	say_debug("snap greatest LSN:%"PRIi64 ", wal greatest LSN:%"PRIi64,
-		  [snap_dir greatest_lsn], [wal_dir greatest_lsn]);
+		  [snap_dir greatest_lsn], [dir greatest_lsn]);
 
 	say_info("local full recovery start");
-	if ([(id)recovery respondsTo:@selector(status_update:)])
+	if (!background && [(id)recovery respondsTo:@selector(status_update:)])
 		[(id)recovery status_update:"loading/local"];
 
 	i64 snap_lsn = [self recover_snap:preferred_snap];
@@ -241,7 +547,7 @@ load_full:(XLog *)preferred_snap
 	 * just after snapshot recovery current_wal isn't known
 	 * so find wal which contains record with _next_ lsn
 	 */
-	current_wal = [wal_dir find_with_lsn:lsn + 1];
+	current_wal = [dir find_with_lsn:lsn + 1];
 
 	if (current_wal != nil)
 		say_info("recover from `%s'", current_wal->filename);
@@ -294,7 +600,10 @@ follow_file(ev_stat *w, int events __attribute__((unused)))
 {
 	XLogReader *reader = w->data;
 	say_debug2("%s: current_wal:%s", __func__, reader->current_wal ? reader->current_wal->filename : NULL);
+	i64 old_lsn = reader->lsn;
 	[reader recover_row_stream:reader->current_wal];
+	if (reader->lsn != old_lsn)
+		reader->lag = ev_time() - reader->row_tm;
 	if ([reader->current_wal eof]) {
 		say_info("done `%s' LSN:%"PRIi64,
 			 reader->current_wal->filename, [reader lsn]);
@@ -303,21 +612,78 @@ follow_file(ev_stat *w, int events __attribute__((unused)))
 	}
 }
 
+#if HAVE_INOTIFY_INIT && HAVE_SYS_INOTIFY_H
+/* any change in dir wakes follower up at once, without waiting
+   for ev_stat or dir rescan timer. Those are kept as a fallback */
+static void
+follow_notify(ev_io *w, int events __attribute__((unused)))
+{
+	XLogReader *reader = w->data;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	/* event details don't matter: current WAL is reread and dir is rescanned */
+	while (read(w->fd, buf, sizeof(buf)) > 0);
+
+	if (reader->current_wal)
+		follow_file(&(ev_stat){ .data = reader }, 0);
+	else
+		follow_dir(&(ev_timer){ .data = reader }, 0);
+}
+#endif
+
+static XLogReader *followed;
+static void
+report_follow_lag(int base __attribute__((unused)))
+{
+	if (followed != nil)
+		stat_report_gauge("lag", sizeof("lag"), [followed lag]);
+}
+
 - (void)
 recover_follow:(ev_tstamp)wal_dir_rescan_delay
 {
 	ev_timer_init(&wal_timer, follow_dir,
 		      wal_dir_rescan_delay / 5, wal_dir_rescan_delay / 5);
 	ev_timer_start(&wal_timer);
+#if HAVE_INOTIFY_INIT && HAVE_SYS_INOTIFY_H
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, dir->dirname, IN_MODIFY | IN_CREATE | IN_MOVED_TO) < 0) {
+		say_syserror("inotify on `%s'", dir->dirname);
+		if (fd >= 0)
+			close(fd);
+	} else {
+		ev_io_init(&wal_notify, follow_notify, fd, EV_READ);
+		wal_notify.data = self;
+		ev_io_start(&wal_notify);
+	}
+#endif
 	if (current_wal != nil)
 		[current_wal follow:follow_file data:self];
+
+	static int stat_base = -1;
+	if (stat_base < 0)
+		stat_base = stat_register_callback("hot_standby", report_follow_lag);
+	if (followed == nil) /* first one is reader of wal_dir */
+		followed = self;
+}
+
+- (void)
+stop_follow
+{
+	ev_timer_stop(&wal_timer);
+	if (ev_is_active(&wal_notify)) {
+		ev_io_stop(&wal_notify);
+		close(wal_notify.fd);
+	}
+	if (followed == self)
+		followed = nil;
 }
 
 
 - (i64)
 recover_finalize
 {
-	ev_timer_stop(&wal_timer);
+	[self stop_follow];
 	/* [currert_wal follow] cb will be stopped by [current_wal close] called by [self close_current_wal] */
 
 	if (lsn > 0) {
@@ -340,7 +706,7 @@ hot_standby
 - (id)
 free
 {
-	ev_timer_stop(&wal_timer);
+	[self stop_follow];
 	[self close_current_wal];
 	return [super free];
 }
@@ -360,6 +726,7 @@ read_log(const char *filename, void (*handler)(struct tbuf *out, u16 tag, struct
 		return -1;
 	}
 
+	[l enable_mmap];
 	palloc_register_cut_point(fiber->pool);
 	while ((row = [l fetch_row])) {
 		struct tbuf out = TBUF(NULL, 0, fiber->pool);
@@ -36,6 +36,7 @@
 #import <paxos.h>
 #import <shard.h>
 #import <cfg/defs.h>
+#import <stat.h>
 
 #include <third_party/crc32.h>
 
@@ -46,11 +47,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <sysexits.h>
+#if defined(__linux__)
+# include <sys/syscall.h>
+#endif
+
+/* snapshot disk I/O is served only when nobody else needs the disk */
+static void
+snap_io_idle(void)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	const int ioprio_who_process = 1, ioprio_class_idle = 3, ioprio_class_shift = 13;
+	if (cfg.snap_io_idle &&
+	    syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift) < 0)
+		say_syserror("ioprio_set");
+#endif
+}
 
 static struct iproto_service *recovery_service;
 i64 fold_scn = 0;
+/* with cfg.fold_jobs > 1: LSN of the fold point and part written by this job */
+static i64 fold_lsn;
+static int fold_part = -1;
 
 static void recovery_iproto_ignore(void);
 static void recovery_iproto(void);
@@ -289,6 +309,14 @@ validate_sop(struct netmsg_head *wbuf, const struct iproto *req, void *data, int
 static void pending_snapshot(ev_timer *w, int events __attribute__((unused)));
 
 @implementation Recovery
+/* fork() duration is proportional to page table size, see slab_alloc_huge_pages */
+static ev_tstamp fork_time;
+static void
+report_fork_time(int base __attribute__((unused)))
+{
+	stat_report_gauge("fork_time", sizeof("fork_time"), fork_time);
+}
+
 - (id)
 init
 {
@@ -297,9 +325,12 @@ init
 	mbox_init(&rt_notify_mbox);
 
 	reader = [[XLogReader alloc] init_recovery:self];
+	for (int i = 1; i < wal_streams; i++)
+		stream_reader[i] = [[XLogReader alloc] init_recovery:self dir:wal_stream_dir[i]];
 	snap_writer = [[SnapWriter alloc] init_state:self];
 
 	ev_init(&snapshot_timer, pending_snapshot);
+	stat_register_callback("snapshot", report_fork_time);
 	return self;
 }
 
@@ -317,6 +348,7 @@ init
 }
 
 - (id<XLogWriter>) writer { return writer; }
+- (id<XLogWriter>) shard_writer:(int)shard_id { return stream_writer[wal_stream(shard_id)]; }
 
 - (Shard<Shard> *)
 shard_alloc:(char)type
@@ -401,8 +433,9 @@ shard_op_create:(int)shard_id sop:(struct shard_op *)sop
 	Shard<Shard> *shard;
 	struct wal_reply *reply;
 	shard = [self shard_create:shard_id scn:1 sop:sop];
-	reply = [writer submit:sop len:sizeof(*sop)
-			   tag:shard_create|TAG_SYS shard_id:shard_id];
+	/* stream writer assigns SCN of the next rows of shard, it must see shard_create */
+	reply = [[self shard_writer:shard_id] submit:sop len:sizeof(*sop)
+					   tag:shard_create|TAG_SYS shard_id:shard_id];
 	if (reply->row_count != 1) {
 		[shard release];
 		iproto_raise(ERR_CODE_UNKNOWN_ERROR, "unable write wal row");
@@ -433,6 +466,24 @@ shard_op_alter_type:(Shard<Shard> *)shard type:(char)type
 }
 
 
+static bool
+fold_point(const struct row_v12 *r)
+{
+	if ((r->tag & ~TAG_MASK) != TAG_WAL)
+		return false;
+	return fold_lsn ? r->lsn == fold_lsn : r->scn == fold_scn;
+}
+
+- (void)
+fold_write:(Shard<Shard> *)shard
+{
+	if (fold_part >= 0)
+		exit([snap_writer snapshot_write_fold_part:fold_part lsn:fold_lsn]);
+	if ([(id)[shard executor] respondsTo:@selector(snapshot_fold)])
+		exit([(id)[shard executor] snapshot_fold]);
+	exit([snap_writer snapshot_write]);
+}
+
 - (void)
 recover_row:(struct row_v12 *)r
 {
@@ -444,6 +495,20 @@ recover_row:(struct row_v12 *)r
 		shard = shard_rt[r->shard_id].shard;
 	int old_ushard = fiber->ushard;
 	static int state = -1;
+
+	if (unlikely(load_phase != LOAD_ALL) && !(shard && shard->dummy)) {
+		int tag = r->tag & TAG_MASK;
+		if (tag != snap_initial && tag != snap_final &&
+		    shard_pass[r->shard_id] != load_pass)
+		{
+			if (load_phase == LOAD_HOT)
+				shard_cold[r->shard_id] = true;
+			if (unlikely(fold_scn) && fold_point(r))
+				[self fold_write:shard];
+			return;
+		}
+	}
+
 	if (shard) {
 		if (r->scn <= shard->scn && shard->snap_loaded && !shard->dummy) {
 			say_debug("%s: skip LSN:%"PRIi64" SCN:%"PRIi64" tag:%s",
@@ -474,6 +539,13 @@ recover_row:(struct row_v12 *)r
 			return;
 		case wal_final:
 			assert(false);
+		case snap_part:
+			/* manifest is resolved by -[XLogReader recover_snap_parts:lsn:]
+			   from local snap_dir only, feeder sends it as is */
+			raise_fmt("snapshot parts can't be loaded from this source");
+		case snap_ref:
+			/* expanded by -[XLogReader recover_snap_ref:] */
+			raise_fmt("snapshot references can't be loaded from this source");
 		case shard_create:
 			if (cfg.hostname == NULL)
 				panic("cfg.hostname is missing");
@@ -506,13 +578,8 @@ recover_row:(struct row_v12 *)r
 
 		[shard recover_row:r];
 
-		if (unlikely(fold_scn)) {
-			if (r->scn == fold_scn && (r->tag & ~TAG_MASK) == TAG_WAL) {
-				if ([(id)[shard executor] respondsTo:@selector(snapshot_fold)])
-					exit([(id)[shard executor] snapshot_fold]);
-				exit([snap_writer snapshot_write]);
-			}
-		}
+		if (unlikely(fold_scn) && fold_point(r))
+			[self fold_write:shard];
 	}
 	@catch (Error *e) {
 		say_error("Recovery: %s at %s:%i\n%s", e->reason, e->file, e->line,
@@ -530,18 +597,155 @@ recover_row:(struct row_v12 *)r
 }
 
 
+/* extra WAL streams have no snapshots of their own: each one is replayed
+   from the WAL holding rows which follow snapshot SCN of its shards.
+   Shards are disjoint between streams, so streams are replayed one after
+   another and rows already in snapshot are skipped by [recover_row] */
+- (void)
+load_streams
+{
+	i64 *scn = palloc(fiber->pool, sizeof(i64) * MAX_SHARD);
+
+	for (int k = 1; k < wal_streams; k++) {
+		XLogDir *dir = wal_stream_dir[k];
+
+		/* shard unknown to snapshot must not exist in the first WAL */
+		for (int i = 0; i < MAX_SHARD; i++) {
+			Shard<Shard> *shard = [self shard:i];
+			scn[i] = wal_stream(i) != k ? -1 : shard ? [shard scn] : 0;
+		}
+
+		i64 file_lsn = [dir find_with_scn_map:scn];
+		if (file_lsn < 0)
+			raise_fmt("%s reading failed", dir->dirname);
+		if (file_lsn == 0)
+			continue;
+
+		XLog *initial_xlog = [dir open_for_read:file_lsn];
+		if (initial_xlog == nil)
+			raise_fmt("can't open WAL LSN:%"PRIi64" in %s", file_lsn, dir->dirname);
+		/* skip rows all shards of the stream already have, if indexed */
+		[initial_xlog seek_scn:scn];
+		stream_lsn[k] = [stream_reader[k] load_incr:initial_xlog];
+	}
+}
+
+static bool
+fold_legacy_snap(XLog *snap)
+{
+	if (![snap isKindOf:[XLog12 class]])
+		return true;
+	struct row_v12 *row = [snap fetch_row];
+	return row == NULL || (row->tag & TAG_MASK) != snap_initial || row->scn != -1;
+}
+
+/* WAL row being the fold point. Jobs must agree on it in advance:
+   each of them applies rows of its own shards only */
+- (i64)
+fold_lsn_after:(i64)snap_lsn
+{
+	i64 lsn = snap_lsn, greatest_lsn = [wal_dir greatest_lsn];
+	int row_count = 0;
+
+	palloc_register_cut_point(fiber->pool);
+	XLog *wal = [wal_dir find_with_lsn:lsn + 1];
+	while (wal != nil) {
+		struct row_v12 *row;
+		while ((row = [wal fetch_row])) {
+			if (row->lsn <= lsn)
+				continue;
+			lsn = row->lsn;
+			if (fold_point(row)) {
+				[wal free];
+				palloc_cutoff(fiber->pool);
+				return lsn;
+			}
+			if (row_count++ > 1024) {
+				palloc_cutoff(fiber->pool);
+				palloc_register_cut_point(fiber->pool);
+				row_count = 0;
+			}
+		}
+		[wal free];
+		wal = lsn < greatest_lsn ? [wal_dir open_for_read:lsn + 1] : nil;
+	}
+	palloc_cutoff(fiber->pool);
+	return -1;
+}
+
+/* shards are spread over cfg.fold_jobs processes, each one loads
+   only its shards and writes them as a snapshot part. Parent
+   adds the manifest when all parts are done */
+- (int)
+fold_jobs:(i64)snap_lsn
+{
+	int jobs = cfg.fold_jobs, ret = 0;
+
+	fold_lsn = [self fold_lsn_after:snap_lsn];
+	if (fold_lsn <= 0) {
+		say_error("unable to find record with SCN:%"PRIi64, fold_scn);
+		return EX_OSFILE;
+	}
+	say_info("folding to SCN:%"PRIi64" LSN:%"PRIi64" by %i jobs", fold_scn, fold_lsn, jobs);
+
+	pid_t *pid = xcalloc(jobs, sizeof(*pid));
+	for (int k = 0; k < jobs; k++) {
+		pid[k] = oct_fork();
+		if (pid[k] < 0) {
+			say_syserror("fork");
+			ret = EX_OSERR;
+			break;
+		}
+		if (pid[k] == 0) {
+			fold_part = k;
+			for (int i = 0; i < MAX_SHARD; i++)
+				shard_pass[i] = i % jobs != k;
+			load_phase = LOAD_HOT;
+			[reader load_full:[snap_dir open_for_read:snap_lsn]];
+			say_error("unable to find record with LSN:%"PRIi64, fold_lsn);
+			exit(EX_OSFILE);
+		}
+	}
+
+	for (int k = 0; k < jobs && pid[k] > 0; k++) {
+		int status = 0;
+		pid_t r;
+		while ((r = waitpid(pid[k], &status, 0)) < 0 && errno == EINTR);
+		if (r < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			say_error("fold job %i failed", k);
+			ret = EX_SOFTWARE;
+		}
+	}
+	free(pid);
+
+	if (ret == 0 && [snap_writer snapshot_write_manifest:jobs lsn:fold_lsn] < 0)
+		ret = EX_OSERR;
+	return ret;
+}
+
 - (i64)
 load_from_local
 {
 	if (fold_scn)  {
 		/* select snapshot before desired scn */
 		XLog *snap = [snap_dir find_with_scn:fold_scn shard:0];
+		if (snap != nil && cfg.fold_jobs > 1) {
+			i64 snap_lsn = snap->lsn;
+			bool legacy = fold_legacy_snap(snap);
+			[snap free];
+			if (!legacy)
+				exit([self fold_jobs:snap_lsn]);
+			say_warn("snapshot without sharding, fold_jobs ignored");
+			snap = [snap_dir open_for_read:snap_lsn];
+		}
 		[reader load_full:snap];
 		say_error("unable to find record with SCN:%"PRIi64, fold_scn);
 		exit(EX_OSFILE);
 	}
 
 	i64 local_lsn = [reader load_full:nil];
+	if (local_lsn > 0)
+		[self load_streams];
 	title(NULL);
 	return local_lsn;
 }
@@ -584,14 +788,131 @@ wal_lock(va_list ap __attribute__((unused)))
 	[recovery enable_local_writes];
 }
 
+static void
+defer_shards(int *shard_pass)
+{
+	const char *p = cfg.recovery_hot_shards;
+
+	for (int i = 0; i < MAX_SHARD; i++)
+		shard_pass[i] = -1;
+
+	while (*p) {
+		char *end;
+		long id = strtol(p, &end, 10);
+		if (end == p || id < 0 || id >= MAX_SHARD)
+			panic("bad recovery_hot_shards: `%s'", cfg.recovery_hot_shards);
+		shard_pass[id] = 0;
+		p = end + strspn(end, ", ");
+	}
+}
+
+/* assign cold shards to background passes: listed in cfg.recovery_cold_shards
+   first, the rest by id, cfg.recovery_cold_batch shards per pass */
+static int
+schedule_cold_shards(int *shard_pass, const bool *shard_cold)
+{
+	const char *p = cfg.recovery_cold_shards ?: "";
+	int batch = cfg.recovery_cold_batch > 0 ? cfg.recovery_cold_batch : MAX_SHARD;
+	int count = 0;
+
+	while (*p) {
+		char *end;
+		long id = strtol(p, &end, 10);
+		if (end == p || id < 0 || id >= MAX_SHARD)
+			panic("bad recovery_cold_shards: `%s'", cfg.recovery_cold_shards);
+		if (shard_cold[id] && shard_pass[id] < 0)
+			shard_pass[id] = 1 + count++ / batch;
+		p = end + strspn(end, ", ");
+	}
+	for (int i = 0; i < MAX_SHARD; i++)
+		if (shard_cold[i] && shard_pass[i] < 0)
+			shard_pass[i] = 1 + count++ / batch;
+
+	return (count + batch - 1) / batch;
+}
+
+static void
+load_deferred(va_list ap)
+{
+	Recovery *r = va_arg(ap, Recovery *);
+	[r load_deferred_shards];
+}
+
+/* background passes over local snapshot and WALs, started by -enable_local_writes:
+   each one loads its batch of cold shards and makes them ready. Routes of cold
+   shards are marked loading and write locked by -simple: until their pass ends
+   classify() admits requests to them and workers wait on route->lock.
+   Rows of other shards are skipped, as are rows written after the first pass:
+   cold shards have none */
+- (void)
+load_deferred_shards
+{
+	ev_tstamp start = ev_now();
+
+	say_info("loading cold shards in %i passes", cold_passes);
+	load_phase = LOAD_DEFERRED;
+	for (load_pass = 1; load_pass <= cold_passes; load_pass++) {
+		XLogReader *deferred_reader = [[XLogReader alloc] init_recovery:self];
+		[deferred_reader set_background:true];
+		@try {
+			[deferred_reader load_full:nil];
+		}
+		@catch (Error *e) {
+			panic("unable to load cold shards: %s", e->reason);
+		}
+		@finally {
+			[deferred_reader free];
+		}
+
+		for (int i = 0; i < MAX_SHARD; i++) {
+			if (shard_pass[i] != load_pass)
+				continue;
+
+			Shard *shard = [self shard:i];
+			if (shard && [shard our_shard])
+				[shard enable_local_writes];
+			else
+				[shard release];
+			shard_rt[i].loading = false;
+			wunlock(&shard_rt[i].lock);
+			say_info("shard %i loaded in %.1f sec", i, ev_now() - start);
+		}
+	}
+	load_phase = LOAD_ALL;
+	load_pass = 0;
+	say_info("cold shards loaded in %.1f sec", ev_now() - start);
+}
+
 - (void)
 simple:(struct iproto_service *)service
 {
 	recovery_service = service;
 	recovery_iproto_ignore();
 
+	if (cfg.recovery_hot_shards && !cfg.local_hot_standby && wal_streams == 1 && !fold_scn) {
+		defer_shards(shard_pass);
+		load_phase = LOAD_HOT;
+	}
+
 	i64 local_lsn = [self load_from_local];
 
+	/* snapshot without sharding: everything is in dummy shard 0, nothing to defer */
+	if ([self shard:0] && [self shard:0]->dummy)
+		load_phase = LOAD_ALL;
+
+	if (load_phase == LOAD_HOT) {
+		cold_passes = schedule_cold_shards(shard_pass, shard_cold);
+		if (cold_passes == 0)
+			load_phase = LOAD_ALL;
+		/* before recovery_iproto(): requests to cold shards wait till they're loaded */
+		for (int i = 0; i < MAX_SHARD; i++) {
+			if (shard_pass[i] <= 0)
+				continue;
+			shard_rt[i].loading = true;
+			wlock(&shard_rt[i].lock);
+		}
+	}
+
 #if CFG_object_space
 	if (local_lsn == 0 && cfg.object_space) {
 		struct feeder_param feeder;
@@ -609,6 +930,9 @@ simple:(struct iproto_service *)service
 
 	if (cfg.local_hot_standby) {
 		[reader hot_standby];
+		for (int i = 1; i < wal_streams; i++)
+			if ([stream_reader[i] lsn] > 0)
+				[stream_reader[i] hot_standby];
 		for (int i = 0; i < MAX_SHARD; i++)
 			[[self shard:i] wal_final_row];
 		fiber_create("wal_lock", wal_lock, self);
@@ -632,6 +956,9 @@ lock
 {
 	if ([wal_dir lock] < 0)
 		panic_syserror("Can't lock wal_dir:%s", wal_dir->dirname);
+	for (int i = 1; i < wal_streams; i++)
+		if ([wal_stream_dir[i] lock] < 0)
+			panic_syserror("Can't lock wal_stream dir:%s", wal_stream_dir[i]->dirname);
 
 	if (!same_dir(wal_dir, snap_dir)) {
 		if ([snap_dir lock] < 0)
@@ -647,9 +974,17 @@ enable_local_writes
 	i64 reader_lsn = [reader recover_finalize];
 	[reader free];
 	reader = nil;
+	for (int i = 1; i < wal_streams; i++) {
+		i64 stream_reader_lsn = [stream_reader[i] recover_finalize];
+		if (stream_reader_lsn > 0)
+			stream_lsn[i] = stream_reader_lsn;
+		[stream_reader[i] free];
+		stream_reader[i] = nil;
+	}
 
 	i64 writer_lsn = reader_lsn;
 	if (reader_lsn == 0) {
+		load_phase = LOAD_ALL;
 		int count = [self load_from_remote];
 		if (count < 1) {
 			say_error("unable to pull initial snapshot");
@@ -682,6 +1017,9 @@ enable_local_writes
 		else
 			[shard release];
 	}
+
+	if (load_phase == LOAD_HOT)
+		fiber_create("load_deferred", load_deferred, self);
 }
 
 static void
@@ -748,11 +1086,18 @@ configure_wal_writer:(i64)lsn
 
 	if (cfg.wal_writer_inbox_size == 0) {
 		writer = [[DummyXLogWriter alloc] init_lsn:lsn];
+		for (int i = 0; i < wal_streams; i++)
+			stream_writer[i] = writer;
 		return;
 	}
 
 	writer = [[XLogWriter alloc] init_lsn:lsn
 					state:self];
+	stream_writer[0] = writer;
+	for (int i = 1; i < wal_streams; i++)
+		stream_writer[i] = [[XLogWriter alloc] init_lsn:stream_lsn[i] ?: 1
+							 state:self
+							stream:i];
 
 	if (cfg.run_crc_delay > 0)
 		fiber_create("run_crc", run_crc_writer, cfg.run_crc_delay);
@@ -779,6 +1124,36 @@ request_snapshot
 	ev_timer_start(&snapshot_timer);
 }
 
+/* extra streams have no snapshots of their own, and their WALs are needed
+   only from the file load_streams would start from for the oldest snapshot
+   in snap_dir. With cfg.wal_stream_cleanup older ones are removed, so they
+   go away together with snapshots which refer to them */
+- (void)
+stream_wal_cleanup
+{
+	i64 snap_lsn, *map, *scn;
+
+	if (wal_streams == 1 || !cfg.wal_stream_cleanup)
+		return;
+	if ((snap_lsn = [snap_dir least_lsn]) <= 0)
+		return;
+
+	map = palloc(fiber->pool, sizeof(i64) * MAX_SHARD);
+	scn = palloc(fiber->pool, sizeof(i64) * MAX_SHARD);
+	memset(map, 0, sizeof(i64) * MAX_SHARD);
+	if ([snap_dir scn_map:map lsn:snap_lsn part:-1] < 0)
+		return;
+
+	for (int k = 1; k < wal_streams; k++) {
+		for (int i = 0; i < MAX_SHARD; i++)
+			scn[i] = wal_stream(i) != k ? -1 : map[i];
+
+		i64 file_lsn = [wal_stream_dir[k] find_with_scn_map:scn];
+		if (file_lsn > 0)
+			[wal_stream_dir[k] remove_older:file_lsn];
+	}
+}
+
 - (int)
 fork_and_snapshot
 {
@@ -793,9 +1168,17 @@ fork_and_snapshot
 		return -1;
 	}
 
+	if (load_phase != LOAD_ALL) {
+		say_error("can't save snapshot: deferred shards are loading");
+		return -1;
+	}
+
 	wlock(&snapshot_lock);
 	lsn = [self lsn];
+	ev_tstamp fork_start = ev_time();
 	p = oct_fork();
+	if (p > 0)
+		fork_time = ev_time() - fork_start;
 	wunlock(&snapshot_lock);
 	switch (p) {
 	case -1:
@@ -815,6 +1198,7 @@ fork_and_snapshot
 			int res _unused_ = write(fd, "900\n", 4);
 			close(fd);
 		}
+		snap_io_idle();
 		int r = [snap_writer snapshot_write];
 
 #ifdef COVERAGE
@@ -826,8 +1210,12 @@ fork_and_snapshot
 		snapshot_running = true;
 		status = wait_for_child(p);
 		snapshot_running = false;
-		if (status == 0)
+		if (status == 0) {
 			last_snapshot_lsn = lsn;
+			if (cfg.snap_keep > 0)
+				[(SnapDir *)snap_dir remove_all_but:cfg.snap_keep];
+			[self stream_wal_cleanup];
+		}
 		return status;
 	}
 }
@@ -238,20 +238,21 @@ replicate_row_stream:(id<XLogPullerAsync>)puller
 			[e release];
 		}
 
+		id<XLogWriter> writer = [recovery shard_writer:rows[0]->shard_id];
 		if (dummy_writer) {
-			[(id)recovery->writer incr_lsn:pack_rows];
+			[(id)writer incr_lsn:pack_rows];
 		} else {
 			int confirmed = 0;
 			while (confirmed != pack_rows) {
 				struct wal_pack pack;
 
-				wal_pack_prepare(recovery->writer, &pack);
+				wal_pack_prepare(writer, &pack);
 				for (int i = confirmed; i < pack_rows; i++) {
 					rows[i]->lsn = 0;
 					wal_pack_append_row(&pack, rows[i]);
 				}
 
-				struct wal_reply *reply = [recovery->writer wal_pack_submit];
+				struct wal_reply *reply = [writer wal_pack_submit];
 				confirmed += reply->row_count;
 				if (confirmed != pack_rows) {
 					say_warn("WAL write failed confirmed:%i != sent:%i",
@@ -31,15 +31,18 @@
 
 #include <third_party/crc32.h>
 
+/* run_crc is a raw crc32c over concatenated payloads, so it can be
+   extended with row->data_crc32c (already computed by writer or verified
+   by reader) instead of hashing the payload a second time */
 void
-run_crc_calc(u32 *crc, u16 row_tag, const void *data, int len)
+run_crc_calc(u32 *crc, const struct row_v12 *row)
 {
-	int tag_type = row_tag & ~TAG_MASK;
-	int tag = row_tag & TAG_MASK;
+	int tag_type = row->tag & ~TAG_MASK;
+	int tag = row->tag & TAG_MASK;
 
 	if ((tag_type == TAG_WAL && (tag == wal_data || tag >= user_tag)) ||
 	    tag == shard_alter)
-		*crc = crc32c(*crc, data, len);
+		*crc = crc32c_combine(*crc, row->data_crc32c, row->len);
 }
 
 void
@@ -192,6 +192,13 @@ submit:(const void *)data len:(u32)len tag:(u16)tag
 	abort();
 }
 
+- (int)
+submit:(const void *)data len:(u32)len tag:(u16)tag durability:(enum wal_durability)durability
+{
+	(void)data; (void)len; (void)tag; (void)durability;
+	abort();
+}
+
 - (int)
 submit_run_crc
 {
@@ -45,12 +45,22 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #if HAVE_LINUX_FALLOC_H
 #include <linux/falloc.h>
 #endif
 
+#ifdef THREADS
+#import <thread_pool.h>
+#endif
+
+#if !HAVE_DECL_FDATASYNC
+extern int fdatasync(int fd);
+#endif
+
 
 struct shard_state {
 	i64 scn, wet_scn;
@@ -59,15 +69,136 @@ struct shard_state {
 
 struct wal_disk_writer_conf {
 	i64 lsn;
+	u64 ring_size;
+	int stream;
 	struct shard_state st[MAX_SHARD];
 };
 
+#define WAL_REQUEST_MAGIC 0xba0babed
+#define WAL_REQUEST_RING_MAGIC 0xba0bab1e
+
+/* Shared memory ring between XLogWriter and wal_disk_writer.
+   Master serializes rows directly into the ring and sends only wal_request
+   headers through the socket. WAL writer appends rows straight from the mapping.
+   Every row is prefixed by wal_ring_entry, entry with zero len means
+   "wrap to the start of ring". Ring space is released when reply with
+   corresponding seq is received. */
+
+struct wal_ring_entry {
+	u32 len;
+	u32 unused;
+	u8 data[];
+};
+
+#define WAL_RING_ALIGN(len) TYPEALIGN(8, (len))
+
+struct wal_ring {
+	char *base;
+	u64 size;
+	u64 head, tail; /* monotonic positions, offset is pos % size */
+	int fd;
+
+	struct wal_ring_pending {
+		i64 seq;
+		u64 end;
+	} *pending;
+	int pending_size, pending_first, pending_count;
+
+	struct mbox_void_ptr mbox;
+};
+
+
+#ifdef THREADS
+/* WALSyncer: fdatasync()s WAL in a separate thread,
+   so WAL writer may append next batch while previous one is synced.
+   Completions are delivered in order of submission.
+   Failed sync is fatal: replies waiting for it must never be sent,
+   and rows written since last good sync can't be taken back */
+@interface WALSyncer: ThreadWorker {
+@public
+	thread_responses responses;
+	i64 submitted, done;
+}
+- (void) sync:(int)fd;
+- (i64) reap;
+@end
+
+@implementation WALSyncer
+static int
+datasync(int fd)
+{
+#if HAVE_FDATASYNC
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+- (id)
+init
+{
+	thread_responses_init(&responses);
+	return [super init_num:1];
+}
+
+- (void)
+sync:(int)fd
+{
+	/* WAL may be closed and freed before sync completes */
+	int dupfd = dup(fd);
+	if (dupfd < 0) {
+		say_syserror("dup");
+		if (datasync(fd) < 0)
+			panic_syserror("can't flush wal");
+		return;
+	}
+	submitted++;
+	[self send:(request_arg){ .i = dupfd }];
+}
+
+- (void)
+thread_loop:(thread_pool_waiter *)waiter
+{
+	for (;;) {
+		thread_pool_request *request = [self pop_request:waiter];
+		if (request->req.cb == NULL)
+			return;
+
+		int fd = request->req.arg.i;
+		int r = datasync(fd);
+		thread_response_internal res = { .result = r, .eno = errno };
+		close(fd);
+		thread_responses_push(&responses, request, res);
+	}
+}
+
+- (i64)
+reap
+{
+	thread_response res;
+
+	/* drain eventfd first: response is linked before eventfd is signaled */
+	thread_responses_possibly_have(&responses);
+	while (thread_responses_get(&responses, &res)) {
+		if (res.result < 0) {
+			errno = res.eno;
+			panic_syserror("can't flush wal");
+		}
+		done++;
+	}
+	return done;
+}
+@end
+#endif
 
 @interface WALDiskWriter: Object {
 @public
 	i64 lsn;
 	XLog *current_wal;	/* the WAL we'r currently reading/writing from/to */
 	XLog *wal_to_close;
+#ifdef THREADS
+	WALSyncer *syncer;
+#endif
 }
 - (id) init_conf:(const struct wal_disk_writer_conf *)conf_;
 @end
@@ -99,6 +230,7 @@ prepare_write:(const struct shard_state *)st
 			scn[i] = st[i].scn ? st[i].scn + 1 : 0;
 
 		current_wal = [wal_dir open_for_write:lsn + 1 scn:scn];
+		[current_wal enable_index:cfg.wal_index_step];
 	}
 
         if (current_wal == nil) {
@@ -124,8 +256,6 @@ prepare_write:(const struct shard_state *)st
 - (i64)
 confirm_write
 {
-	static ev_tstamp last_flush;
-
 	if (current_wal != nil) {
 		i64 confirmed_lsn = [current_wal confirm_write];
 
@@ -143,16 +273,44 @@ confirm_write
 			}
 
 			say_info("created `%s'", current_wal->filename);
+
+			/* eof marker is written only after next WAL is created and renamed,
+			   so readers following WAL never see eof without next file */
 			[wal_to_close free];
 			wal_to_close = nil;
 		}
 
 		lsn = confirmed_lsn;
+	}
+
+	return lsn;
+}
 
-		if (cfg.wal_fsync_delay >= 0 && ev_now() - last_flush >= cfg.wal_fsync_delay) {
+/* fsync confirmed rows if it's time to (see wal_fsync_delay) or if forced
+   by request durability, then rotate WAL if it's full */
+- (void)
+sync_and_rotate:(bool)force
+{
+	static ev_tstamp last_flush;
+
+	if (current_wal != nil) {
+		if (force ||
+		    (cfg.wal_fsync_delay >= 0 && ev_now() - last_flush >= cfg.wal_fsync_delay))
+		{
+#ifdef THREADS
+			if (syncer != nil) {
+				/* rows are already written out by [confirm_write] */
+				[syncer sync:[current_wal fileno]];
+				last_flush = ev_now();
+			} else
+#endif
 			/* note: [flush] silently drops unwritten rows.
 			   it's ok here because of previous call to [confirm_write] */
 			if ([current_wal flush] < 0) {
+				/* rows are in WAL already, so SYNC replies can't
+				   be taken back: see WALSyncer */
+				if (force)
+					panic_syserror("can't flush wal");
 				say_syserror("can't flush wal");
 			} else {
 				ev_now_update();
@@ -163,12 +321,19 @@ confirm_write
 		if (cfg.rows_per_wal <= [current_wal rows] ||
 		    (lsn + 1) % cfg.rows_per_wal == 0)
 		{
+			[wal_to_close free]; /* next WAL wasn't created since last rotation */
 			wal_to_close = current_wal;
 			current_wal = nil;
 		}
 	}
+}
 
-	return lsn;
+/* housekeeping off the commit path, called when there is no pending input */
+- (void)
+idle
+{
+	if (cfg.wal_writer_spare && ![wal_dir has_spare])
+		[wal_dir prepare_spare];
 }
 
 @end
@@ -176,20 +341,28 @@ confirm_write
 struct request {
 	u32 row_count;
 	int shard_id;
+	u8 durability;
+	bool early; /* reply is sent before fsync */
 	i64 epoch;
 	struct wal_reply *reply;
 	struct row_v12 **rows;
 };
 
 #define BATCH_SIZE 1024
-static int flush(int fd, const struct request *requests, int count)
+/* send replies of requests with request->early == early */
+static int flush(int fd, const struct request *requests, int request_count, bool early)
 {
 	struct iovec iovbuf[BATCH_SIZE], *iov = iovbuf;
-	for (int i = 0; i < count; i++) {
+	int count = 0;
+	for (int i = 0; i < request_count; i++) {
+		if (requests[i].early != early)
+			continue;
 		struct wal_reply *reply = requests[i].reply;
-		iov[i] = (struct iovec){ .iov_base = reply,
-					 .iov_len = reply->packet_len };
+		iov[count++] = (struct iovec){ .iov_base = reply,
+					       .iov_len = reply->packet_len };
 	}
+	if (count == 0)
+		return 0;
 
 	do {
 		ssize_t r = writev(fd, iov, count);
@@ -213,6 +386,43 @@ static int flush(int fd, const struct request *requests, int count)
 	return 0;
 }
 
+#ifdef THREADS
+/* replies of a batch, delayed until sync with given ticket is completed */
+struct pending_replies {
+	i64 sync_ticket;
+	i64 epoch;
+	u32 len;
+	char data[];
+} __attribute__((packed));
+
+static int
+flush_pending(int fd, struct tbuf *pending, i64 sync_done, i64 *sent_epoch, i64 *sent_ticket)
+{
+	while (tbuf_len(pending) > 0) {
+		struct pending_replies *p = pending->ptr;
+		if (p->sync_ticket > sync_done)
+			break;
+
+		const char *ptr = p->data;
+		size_t len = p->len;
+		while (len > 0) {
+			ssize_t r = write(fd, ptr, len);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			ptr += r;
+			len -= r;
+		}
+		*sent_epoch = p->epoch;
+		*sent_ticket = p->sync_ticket;
+		tbuf_ltrim(pending, sizeof(*p) + p->len);
+	}
+	return 0;
+}
+#endif
+
 static int
 request_row_count(struct tbuf *rbuf)
 {
@@ -227,12 +437,32 @@ request_row_count(struct tbuf *rbuf)
 	return -1;
 }
 
+static char *ring_base;
+static u64 ring_size;
+
+static struct row_v12 *
+ring_row(u32 *offt)
+{
+	struct wal_ring_entry *e = (void *)(ring_base + *offt);
+	if (e->len == 0) { /* wrap */
+		*offt = 0;
+		e = (void *)ring_base;
+	}
+	*offt += WAL_RING_ALIGN(sizeof(*e) + e->len);
+	if (*offt == ring_size)
+		*offt = 0;
+
+	struct row_v12 *h = (void *)e->data;
+	assert(e->len == sizeof(*h) + h->len);
+	return h;
+}
+
 static void
 request_parse(struct request *request, int row_count, struct tbuf *rbuf)
 {
 	tbuf_ltrim(rbuf, sizeof(u32[2])); /* drop packet_len & row_count */
 	u32 magic = read_u32(rbuf);
-	assert(magic == 0xba0babed);
+	assert(magic == WAL_REQUEST_MAGIC || magic == WAL_REQUEST_RING_MAGIC);
 
 	request->row_count = row_count;
 	request->rows = p0alloc(fiber->pool, sizeof(void *) * row_count);
@@ -241,13 +471,21 @@ request_parse(struct request *request, int row_count, struct tbuf *rbuf)
 				 row_count * sizeof(request->reply->row_crc[0]));
 	request->reply->seq = read_u64(rbuf);
 	request->epoch = read_u64(rbuf);
+	u32 ring_offt = read_u32(rbuf);
+	request->durability = read_u8(rbuf);
+	request->early = false;
 	request->reply->scn = -1;
 	request->reply->lsn = -1;
 	request->shard_id = -1;
 
 	for (int i = 0; i < row_count; i++) {
-		struct row_v12 *h = read_bytes(rbuf, sizeof(*h));
-		tbuf_ltrim(rbuf, h->len); /* row data */
+		struct row_v12 *h;
+		if (magic == WAL_REQUEST_RING_MAGIC) {
+			h = ring_row(&ring_offt);
+		} else {
+			h = read_bytes(rbuf, sizeof(*h));
+			tbuf_ltrim(rbuf, h->len); /* row data */
+		}
 		request->rows[i] = h;
 		assert(request->shard_id == -1 || request->shard_id == h->shard_id);
 		request->shard_id = h->shard_id;
@@ -304,7 +542,7 @@ commit_scn(struct shard_state *st, struct wal_reply *reply, const struct row_v12
 		      reply->row_count, (const char *)buf->ptr);
 	}
 
-	run_crc_calc(&st->run_crc, row->tag, row->data, row->len);
+	run_crc_calc(&st->run_crc, row);
 	struct run_crc_hist *row_crc = reply->row_crc + reply->crc_count++;
 	row_crc->scn = row->scn;
 	row_crc->value = st->run_crc;
@@ -314,23 +552,52 @@ commit_scn(struct shard_state *st, struct wal_reply *reply, const struct row_v12
 }
 
 int
-wal_disk_writer(int fd, int cfd __attribute__((unused)), void *state, int len)
+wal_disk_writer(int fd, int cfd, void *state, int len)
 {
 	struct wal_disk_writer_conf *conf = state;
+	/* child writes only its own stream */
+	wal_dir = wal_stream_dir[conf->stream];
 	WALDiskWriter *writer = [[WALDiskWriter alloc] init_conf:conf];
 	struct shard_state *st = conf->st;
 	struct request requests[BATCH_SIZE];
 	struct tbuf rbuf = TBUF(NULL, 0, fiber->pool);
+#ifdef THREADS
+	struct tbuf pending = TBUF(NULL, 0, fiber->pool);
+	i64 sent_ticket = 0; /* sync ticket of last sent pending replies */
+	static i64 delayed_ticket[MAX_SHARD]; /* ticket of last delayed reply of shard */
+#endif
+	static u32 delayed_batch[MAX_SHARD]; /* last batch with delayed reply of shard */
+	u32 batch = 0;
 	int result = EXIT_FAILURE;
 	i64 start_lsn;
 	ssize_t r;
 	int request_count;
 	i64 epoch = 0;
+	i64 sent_epoch = 0; /* epoch of last reply sent to master */
 
 	assert(sizeof(*conf) == len);
 
 	ev_tstamp start_time = ev_now();
 	palloc_register_gc_root(fiber->pool, &rbuf, tbuf_gc);
+#ifdef THREADS
+	palloc_register_gc_root(fiber->pool, &pending, tbuf_gc);
+	if (cfg.wal_fsync_pipeline)
+		writer->syncer = [[WALSyncer alloc] init];
+#else
+	if (cfg.wal_fsync_pipeline)
+		say_warn("wal_fsync_pipeline requires threads support, ignored");
+#endif
+
+	if (cfd >= 0) {
+		ring_size = conf->ring_size;
+		ring_base = mmap(NULL, ring_size, PROT_READ|PROT_WRITE, MAP_SHARED, cfd, 0);
+		if (ring_base == MAP_FAILED) {
+			say_syserror("mmap");
+			return EX_OSERR;
+		}
+		close(cfd);
+		say_info("using shared ring, %"PRIu64" bytes", ring_size);
+	}
 
 	say_debug("%s: configured LSN:%"PRIi64, __func__, conf->lsn);
 	for (int i = 0; i < MAX_SHARD; i++)
@@ -346,6 +613,30 @@ wal_disk_writer(int fd, int cfd __attribute__((unused)), void *state, int len)
 	signal(SIGUSR1, SIG_IGN);
 
 	for (;;) {
+#ifdef THREADS
+		/* wait for either next batch or sync completion of delayed replies */
+		while (tbuf_len(&pending) > 0) {
+			struct pollfd pfd[2] = { { .fd = fd, .events = POLLIN },
+						 { .fd = writer->syncer->responses.ifd, .events = POLLIN } };
+			if (poll(pfd, nelem(pfd), -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				say_syserror("poll");
+				result = EX_OSERR;
+				goto exit;
+			}
+			if (pfd[1].revents &&
+			    flush_pending(fd, &pending, [writer->syncer reap],
+					  &sent_epoch, &sent_ticket) < 0)
+			{
+				/* parent is dead, exit quetly */
+				result = EX_OK;
+				goto exit;
+			}
+			if (pfd[0].revents)
+				break;
+		}
+#endif
 		tbuf_ensure(&rbuf, 16 * 1024);
 		r = tbuf_recv(&rbuf, fd);
 		if (r < 0 && (errno == EINTR))
@@ -365,6 +656,7 @@ wal_disk_writer(int fd, int cfd __attribute__((unused)), void *state, int len)
 		}
 
 		request_count = 0;
+		batch++;
 		start_lsn = writer->lsn;
 		if ([writer prepare_write:st] == -1)
 			epoch++;
@@ -443,15 +735,85 @@ wal_disk_writer(int fd, int cfd __attribute__((unused)), void *state, int len)
 				  i, reply->row_count, reply->lsn, reply->scn);
 		}
 
-		if (flush(fd, requests, request_count) < 0) {
+		/* staggered replies: requests satisfied by page cache are replied
+		   before fsync. Master matches replies by seq, but relies on their
+		   order to track epoch, so reply may overtake others only if no
+		   epoch change is pending. Shard applies SCN from replies in arrival
+		   order, so reply may not overtake delayed replies of the same shard
+		   either: neither of this batch nor of earlier ones */
+		bool force_sync = false;
+		for (int i = 0; i < request_count; i++) {
+			struct request *request = &requests[i];
+			struct wal_reply *reply = request->reply;
+			int shard_id = request->shard_id;
+
+			if (request->durability >= WAL_DURABILITY_SYNC && reply->row_count > 0)
+				force_sync = true;
+			if (shard_id < 0) /* empty request */
+				continue;
+			request->early = request->durability == WAL_DURABILITY_WRITE &&
+					 reply->row_count == request->row_count &&
+					 reply->epoch == sent_epoch &&
+#ifdef THREADS
+					 delayed_ticket[shard_id] <= sent_ticket &&
+#endif
+					 delayed_batch[shard_id] != batch;
+			if (!request->early)
+				delayed_batch[shard_id] = batch;
+		}
+		if (flush(fd, requests, request_count, true) < 0) {
 			/* parent is dead, exit quetly */
 			result = EX_OK;
 			goto exit;
 		}
 
+		[writer sync_and_rotate:force_sync];
+
+#ifdef THREADS
+		if (writer->syncer != nil) {
+			/* replies are sent after all syncs submitted so far are completed */
+			struct pending_replies p = { .sync_ticket = writer->syncer->submitted,
+						     .epoch = epoch };
+			for (int i = 0; i < request_count; i++)
+				if (!requests[i].early)
+					p.len += requests[i].reply->packet_len;
+			if (p.len > 0) {
+				tbuf_append(&pending, &p, sizeof(p));
+				for (int i = 0; i < request_count; i++)
+					if (!requests[i].early) {
+						tbuf_append(&pending, requests[i].reply,
+							    requests[i].reply->packet_len);
+						if (requests[i].shard_id >= 0)
+							delayed_ticket[requests[i].shard_id] = p.sync_ticket;
+					}
+			}
+
+			if (flush_pending(fd, &pending, [writer->syncer reap],
+					  &sent_epoch, &sent_ticket) < 0) {
+				/* parent is dead, exit quetly */
+				result = EX_OK;
+				goto exit;
+			}
+		} else
+#endif
+		{
+			if (flush(fd, requests, request_count, false) < 0) {
+				/* parent is dead, exit quetly */
+				result = EX_OK;
+				goto exit;
+			}
+			sent_epoch = epoch;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, 0) == 0)
+			[writer idle];
+
 		fiber_gc();
 	}
 exit:
+	[writer->wal_to_close free];
+	writer->wal_to_close = nil;
 	[writer->current_wal free];
 	writer->current_wal = nil;
 	return result;
@@ -482,10 +844,152 @@ submit:(const void *)data len:(u32)data_len tag:(u16)tag shard_id:(u16)shard_id
 	return &reply;
 }
 
+- (struct wal_reply *)
+submit:(const void *)data len:(u32)data_len tag:(u16)tag shard_id:(u16)shard_id
+durability:(enum wal_durability)durability
+{
+	(void)durability;
+	return [self submit:data len:data_len tag:tag shard_id:shard_id];
+}
+
 @end
 
+static struct wal_ring *
+wal_ring_create(u64 size)
+{
+#if HAVE_MEMFD_CREATE
+	size = WAL_RING_ALIGN(size);
+	int fd = memfd_create("wal_ring", MFD_CLOEXEC);
+	if (fd < 0) {
+		say_syserror("memfd_create");
+		return NULL;
+	}
+	if (ftruncate(fd, size) < 0) {
+		say_syserror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	void *base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		say_syserror("mmap");
+		close(fd);
+		return NULL;
+	}
+
+	struct wal_ring *ring = xcalloc(1, sizeof(*ring));
+	ring->base = base;
+	ring->size = size;
+	ring->fd = fd;
+	ring->pending_size = 64;
+	ring->pending = xmalloc(ring->pending_size * sizeof(*ring->pending));
+	mbox_init(&ring->mbox);
+	return ring;
+#else
+	(void)size;
+	say_warn("shared memory WAL ring is not supported, falling back to socket");
+	return NULL;
+#endif
+}
+
+static u64
+wal_ring_free(const struct wal_ring *ring)
+{
+	return ring->size - (ring->head - ring->tail);
+}
+
+static struct wal_ring_entry *
+wal_ring_entry(const struct wal_ring *ring, u64 pos)
+{
+	return (struct wal_ring_entry *)(ring->base + pos % ring->size);
+}
+
+/* returns position of reserved entry or -1 if there is no space left */
+static u64
+wal_ring_reserve(struct wal_ring *ring, u32 len)
+{
+	u64 need = WAL_RING_ALIGN(sizeof(struct wal_ring_entry) + len),
+	    offt = ring->head % ring->size,
+	    gap = 0;
+
+	if (ring->size - offt < need)
+		gap = ring->size - offt;
+	if (wal_ring_free(ring) < gap + need)
+		return (u64)-1;
+
+	if (gap) {
+		wal_ring_entry(ring, ring->head)->len = 0; /* wrap marker */
+		ring->head += gap;
+	}
+
+	u64 pos = ring->head;
+	wal_ring_entry(ring, pos)->len = len;
+	ring->head += need;
+	return pos;
+}
+
+static void
+wal_ring_pending_push(struct wal_ring *ring, i64 seq, u64 end)
+{
+	if (ring->pending_count == ring->pending_size) {
+		struct wal_ring_pending *p = xmalloc(ring->pending_size * 2 * sizeof(*p));
+		for (int i = 0; i < ring->pending_count; i++)
+			p[i] = ring->pending[(ring->pending_first + i) % ring->pending_size];
+		free(ring->pending);
+		ring->pending = p;
+		ring->pending_first = 0;
+		ring->pending_size *= 2;
+	}
+	int i = (ring->pending_first + ring->pending_count++) % ring->pending_size;
+	ring->pending[i] = (struct wal_ring_pending){ .seq = seq, .end = end };
+}
+
+static void
+wal_ring_release(struct wal_ring *ring, i64 seq)
+{
+	static struct msg_void_ptr msg;
+
+	while (ring->pending_count > 0) {
+		struct wal_ring_pending *p = ring->pending + ring->pending_first;
+		if (p->seq > seq)
+			break;
+		ring->tail = p->end;
+		ring->pending_first = (ring->pending_first + 1) % ring->pending_size;
+		ring->pending_count--;
+	}
+
+	if (msg.link.tqe_prev == NULL)
+		mbox_put(&ring->mbox, &msg, link);
+}
+
 @implementation XLogWriter
 
+static struct wal_reply err_reply; /* row_count == 0 => error */
+
+volatile struct wal_latency *wal_latency;
+
+static void
+wal_latency_init(void)
+{
+	if (wal_latency != NULL || cfg.snap_io_latency_target <= 0)
+		return;
+
+	void *ptr = mmap(NULL, sizeof(struct wal_latency), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		say_syserror("mmap");
+		return;
+	}
+	wal_latency = ptr;
+}
+
+static void
+wal_latency_record(ev_tstamp start)
+{
+	ev_tstamp now = ev_time();
+	wal_latency->commit += (now - start - wal_latency->commit) / 8;
+	wal_latency->updated = now;
+}
+
 static void
 wal_disk_writer_input_dispatch(ev_io *ev, int __attribute__((unused)) events)
 {
@@ -493,7 +997,6 @@ wal_disk_writer_input_dispatch(ev_io *ev, int __attribute__((unused)) events)
 	struct netmsg_io *io = container_of(ev, struct netmsg_io, in);
 	struct tbuf *rbuf = &io->rbuf;
 
-	static struct wal_reply err_reply;
 	ssize_t r;
 	do {
 		tbuf_ensure(rbuf, 128 * 1024);
@@ -512,11 +1015,18 @@ wal_disk_writer_input_dispatch(ev_io *ev, int __attribute__((unused)) events)
 	while (tbuf_len(rbuf) > sizeof(u32) &&
 	       tbuf_len(rbuf) >= *(u32 *)rbuf->ptr)
 	{
-		struct wal_pack *pack = TAILQ_FIRST(&self->wal_queue);
 		struct wal_reply *reply = read_bytes(rbuf, *(u32 *)rbuf->ptr);
-		assert(pack->seq == reply->seq);
+		struct wal_pack *pack;
+
+		/* replies may be staggered by durability level: see wal_disk_writer() */
+		TAILQ_FOREACH(pack, &self->wal_queue, link)
+			if (pack->seq == reply->seq)
+				break;
+
+		if (self->ring)
+			wal_ring_release(self->ring, reply->seq);
 
-		if (reply->row_count > 0) /* success or partial success */
+		if (pack != NULL && reply->row_count > 0) /* success or partial success */
 			resume(pack->fiber, reply);
 
 		if (reply->epoch == self->epoch)
@@ -525,7 +1035,7 @@ wal_disk_writer_input_dispatch(ev_io *ev, int __attribute__((unused)) events)
 			struct wal_pack *tmp;
 			TAILQ_FOREACH_REVERSE_SAFE(pack, &self->wal_queue, wal_pack_tailq, link, tmp) {
 				assert(pack->epoch == self->epoch);
-				resume(pack->fiber, &err_reply); /* row_count == 0 => error */
+				resume(pack->fiber, &err_reply);
 			}
 			self->epoch = reply->epoch;
 		} else {
@@ -567,6 +1077,14 @@ void optimistic_write(ev_prepare *ev, int events __attribute__((unused)))
 - (id)
 init_lsn:(i64)init_lsn
    state:(id<RecoveryState>)state_
+{
+	return [self init_lsn:init_lsn state:state_ stream:0];
+}
+
+- (id)
+init_lsn:(i64)init_lsn
+   state:(id<RecoveryState>)state_
+  stream:(int)stream
 {
 	assert(init_lsn > 0);
 #if CFG_object_space
@@ -579,22 +1097,39 @@ init_lsn:(i64)init_lsn
 	if (cfg.rows_per_wal <= 4)
 		panic("inacceptable value of 'rows_per_wal'");
 
-	say_info("Configuring WAL writer LSN:%"PRIi64, lsn);
+	say_info("Configuring WAL writer LSN:%"PRIi64" dir:%s", lsn, wal_stream_dir[stream]->dirname);
+	wal_latency_init();
 
 	struct wal_disk_writer_conf *conf = xcalloc(1, sizeof(*conf));
 	conf->lsn = lsn;
+	conf->stream = stream;
+
+	int ring_fd = -1;
+	if (cfg.wal_writer_ring_size > 0) {
+		ring = wal_ring_create((u64)cfg.wal_writer_ring_size * 1024 * 1024);
+		if (ring) {
+			ring_fd = ring->fd;
+			conf->ring_size = ring->size;
+			say_info("\tshared ring %iMB", cfg.wal_writer_ring_size);
+		}
+	}
+
 	for (int i = 0; i < MAX_SHARD; i++) {
 		id<Shard> shard = [state shard:i];
-		if (shard == nil)
+		if (shard == nil || wal_stream(i) != stream)
 			continue;
 		conf->st[i].scn = [shard scn];
 		conf->st[i].run_crc = [shard run_crc_log];
 		if (conf->st[i].scn)
 			say_info("\tShard:%i SCN:%"PRIi64, i, conf->st[i].scn);
 	}
-	wal_writer = spawn_child("wal_writer", wal_disk_writer, -1, conf, sizeof(*conf));
+	wal_writer = spawn_child("wal_writer", wal_disk_writer, ring_fd, conf, sizeof(*conf));
 	if (wal_writer.pid < 0)
 		panic("unable to start WAL writer");
+	if (ring) {
+		close(ring->fd); /* mapping stays valid */
+		ring->fd = -1;
+	}
 	io = [netmsg_io alloc];
 	netmsg_io_init(io, palloc_create_pool((struct palloc_config){.name = "wal_writer"}), wal_writer.fd);
 	ev_init(&io->in, wal_disk_writer_input_dispatch);
@@ -611,12 +1146,21 @@ init_lsn:(i64)init_lsn
 
 - (struct wal_reply *)
 submit:(const void *)data len:(u32)data_len tag:(u16)tag shard_id:(u16)shard_id
+{
+	return [self submit:data len:data_len tag:tag shard_id:shard_id
+		 durability:WAL_DURABILITY_DEFAULT];
+}
+
+- (struct wal_reply *)
+submit:(const void *)data len:(u32)data_len tag:(u16)tag shard_id:(u16)shard_id
+durability:(enum wal_durability)durability
 {
 	struct row_v12 row = { .scn = 0,
 			       .tag = tag,
 			       .shard_id = shard_id };
 	struct wal_pack pack;
 	wal_pack_prepare(self, &pack);
+	wal_pack_set_durability(&pack, durability);
 	wal_pack_append_row(&pack, &row);
 	wal_pack_append_data(&pack, data, data_len);
 	return [self wal_pack_submit];
@@ -625,18 +1169,124 @@ submit:(const void *)data len:(u32)data_len tag:(u16)tag shard_id:(u16)shard_id
 void
 wal_pack_prepare(XLogWriter *w, struct wal_pack *pack)
 {
+	/* throttle before pack is queued: rows of a single pack must be
+	   appended to the ring without yielding */
+	while (w->ring && wal_ring_free(w->ring) < w->ring->size / 4 &&
+	       !TAILQ_EMPTY(&w->wal_queue))
+	{
+		mbox_clear(&w->ring->mbox);
+		mbox_wait(&w->ring->mbox);
+	}
+
 	TAILQ_INSERT_TAIL(&w->wal_queue, pack, link);
 	pack->netmsg = &w->io->wbuf;
 	pack->fiber = fiber;
 	pack->seq = w->seq++;
 	pack->epoch = w->epoch;
+	pack->ring = w->ring;
+	pack->ring_start = w->ring ? w->ring->head : 0;
 	pack->request = palloc(pack->netmsg->pool, sizeof(*pack->request));
 	pack->request->packet_len = sizeof(*pack->request);
-	pack->request->magic = 0xba0babed;
+	pack->request->magic = pack->ring ? WAL_REQUEST_RING_MAGIC : WAL_REQUEST_MAGIC;
 	pack->request->seq = pack->seq;
 	pack->request->epoch = pack->epoch;
 	pack->request->row_count = 0;
-	net_add_iov(pack->netmsg, pack->request, pack->request->packet_len);
+	pack->request->ring_offt = 0;
+	pack->request->durability = WAL_DURABILITY_DEFAULT;
+	if (pack->ring == NULL)
+		net_add_iov(pack->netmsg, pack->request, pack->request->packet_len);
+	/* with ring, request is sent by [wal_pack_submit] */
+}
+
+/* pack doesn't fit into the ring: move rows already appended to the ring
+   into netmsg and send whole pack through socket. Pack is never split:
+   it's appended without yielding, so its rows are the last ones in the ring */
+static void
+wal_pack_ring_fallback(struct wal_pack *pack)
+{
+	struct wal_ring *ring = pack->ring;
+	u64 pos = pack->ring_start;
+
+	say_warn("WAL ring overflow, rows:%i, sending pack through socket",
+		 pack->request->row_count);
+
+	pack->ring = NULL;
+	pack->request->magic = WAL_REQUEST_MAGIC;
+	pack->request->ring_offt = 0;
+	net_add_iov(pack->netmsg, pack->request, sizeof(*pack->request));
+
+	for (int i = 0; i < pack->request->row_count; i++) {
+		struct wal_ring_entry *e = wal_ring_entry(ring, pos);
+		if (e->len == 0) { /* wrap marker */
+			pos += ring->size - pos % ring->size;
+			e = wal_ring_entry(ring, pos);
+		}
+		pack->row = palloc(pack->netmsg->pool, e->len);
+		memcpy(pack->row, e->data, e->len);
+		net_add_iov(pack->netmsg, pack->row, e->len);
+		pack->request->packet_len += e->len;
+		pos += WAL_RING_ALIGN(sizeof(*e) + e->len);
+	}
+
+	ring->head = pack->ring_start;
+}
+
+/* returns false if row didn't fit and pack is switched to socket */
+static bool
+wal_pack_ring_append_row(struct wal_pack *pack, struct row_v12 *row)
+{
+	struct wal_ring *ring = pack->ring;
+	u32 row_len = sizeof(*row) + row->len;
+
+	u64 pos = wal_ring_reserve(ring, row_len);
+	if (pos == (u64)-1) {
+		wal_pack_ring_fallback(pack);
+		return false;
+	}
+
+	if (pack->request->row_count == 0)
+		pack->request->ring_offt = pos % ring->size;
+	pack->request->row_count++;
+	pack->ring_row = pos;
+	pack->row = (struct row_v12 *)wal_ring_entry(ring, pos)->data;
+	memcpy(pack->row, row, row_len);
+	return true;
+}
+
+/* returns false if data didn't fit and pack is switched to socket */
+static bool
+wal_pack_ring_append_data(struct wal_pack *pack, const void *data, size_t len)
+{
+	struct wal_ring *ring = pack->ring;
+
+	/* row is always the last entry, so it's safe to re-reserve it with larger size.
+	   if it doesn't fit anymore, wrap marker is placed at its old position
+	   and row is moved to the start of ring */
+	struct wal_ring_entry *old = wal_ring_entry(ring, pack->ring_row);
+	u32 old_len = old->len;
+
+	ring->head = pack->ring_row;
+	u64 pos = wal_ring_reserve(ring, old_len + len);
+	if (pos == (u64)-1) {
+		/* failed reserve leaves old entry intact */
+		wal_pack_ring_fallback(pack);
+		return false;
+	}
+
+	struct wal_ring_entry *e = wal_ring_entry(ring, pos);
+	if (e != old)
+		memmove(e->data, old->data, old_len);
+	memcpy(e->data + old_len, data, len);
+	pack->ring_row = pos;
+	pack->row = (struct row_v12 *)e->data;
+	pack->row->len += len;
+	return true;
+}
+
+void
+wal_pack_set_durability(struct wal_pack *pack, enum wal_durability durability)
+{
+	pack->request->durability = durability;
 }
 
 u32
@@ -645,6 +1295,9 @@ wal_pack_append_row(struct wal_pack *pack, struct row_v12 *row)
 	assert(pack->request->row_count <= WAL_PACK_MAX);
 	assert(row->tag & ~TAG_MASK);
 
+	if (pack->ring && wal_pack_ring_append_row(pack, row))
+		return WAL_PACK_MAX - pack->request->row_count;
+
 	pack->request->packet_len += sizeof(*row) + row->len;
 	pack->request->row_count++;
 
@@ -662,6 +1315,9 @@ wal_pack_append_row(struct wal_pack *pack, struct row_v12 *row)
 void
 wal_pack_append_data(struct wal_pack *pack, const void *data, size_t len)
 {
+	if (pack->ring && wal_pack_ring_append_data(pack, data, len))
+		return;
+
 	pack->request->packet_len += len;
 	pack->row->len += len;
 	if (len < 512)
@@ -674,10 +1330,26 @@ wal_pack_append_data(struct wal_pack *pack, const void *data, size_t len)
 wal_pack_submit
 {
 	struct wal_pack *pack = TAILQ_LAST(&wal_queue, wal_pack_tailq);
+
+	if (pack->ring) {
+		if (pack->request->row_count == 0) {
+			/* nothing is sent, pack is the last one: see [wal_pack_prepare] */
+			TAILQ_REMOVE(&wal_queue, pack, link);
+			seq--;
+			return &err_reply;
+		}
+
+		wal_ring_pending_push(ring, pack->seq, ring->head);
+		net_add_iov(pack->netmsg, pack->request, pack->request->packet_len);
+	}
+
+	ev_tstamp start = wal_latency ? ev_time() : 0;
 	struct wal_reply *reply = yield();
+	if (wal_latency)
+		wal_latency_record(start);
 	if (reply->row_count == 0)
 		say_warn("WAL writer returned error status");
-	else
+	else if (reply->lsn > lsn) /* early replies may come before delayed ones */
 		lsn = reply->lsn;
 
 	say_debug("%s: => rows:%i LSN:%"PRIi64, __func__, reply->row_count, lsn);
@@ -686,6 +1358,51 @@ wal_pack_submit
 }
 @end
 
+/* collects rows written by -[Shard snapshot_write_header:] */
+@interface SnapHeader : XLog {
+@public
+	struct tbuf *rows;
+}
+@end
+
+@implementation SnapHeader
+- (id)
+init
+{
+	[super init];
+	mode = LOG_WRITE; /* -[XLog free] checks nothing else for fd-less log */
+	return self;
+}
+
+- (const struct row_v12 *)
+append_row:(struct row_v12 *)row data:(const void *)data
+{
+	tbuf_append(rows, row, sizeof(*row));
+	tbuf_append(rows, data, row->len);
+	return row;
+}
+@end
+
+struct snap_shard {
+	u16 id;
+	i64 scn;
+	id<Executor> executor;
+	struct tbuf *header;	/* shard_create row(s) */
+	u32 rows;		/* estimated */
+	bool reuse;		/* unchanged: ref points to rows in older snapshot */
+	struct snap_ref ref;	/* where rows of shard are */
+};
+
+/* -snapshot_write_parts: writes shards into several files concurrently */
+struct snap_part {
+	SnapWriter *writer;
+	XLog *snap;
+	int n;
+	int *shard, shard_count;
+	u32 rows;
+	int ret, eno;
+};
+
 @implementation SnapWriter
 
 - (id)
@@ -696,33 +1413,479 @@ init_state:(id<RecoveryState>)state_
 	return self;
 }
 
+/* Capture everything snapshot needs from live state, so -snapshot_write
+   and its part writers touch only executors afterwards */
+- (void)
+snapshot_freeze
+{
+	SnapHeader *capture = [[SnapHeader alloc] init];
+
+	assert(!frozen);
+	lsn = [state lsn];
+	total_rows = 0;
+	legacy_mode = false;
+	shard_count = 0;
+	shard = xcalloc(MAX_SHARD, sizeof(*shard));
+	scn = xcalloc(MAX_SHARD, sizeof(*scn));
+
+	for (int i = 0; i < MAX_SHARD; i++) {
+		Shard<Shard> *s = [state shard:i];
+		if (s == nil)
+			continue;
+		if (i == 0 && s->dummy) {
+			legacy_mode = true;
+			legacy_run_crc = [s run_crc_log];
+		}
+
+		struct snap_shard *ss = &shard[shard_count++];
+		ss->id = i;
+		ss->scn = scn[i] = [s scn];
+		ss->executor = [s executor];
+		ss->rows = [ss->executor snapshot_estimate];
+		total_rows += ss->rows;
+
+		if (!legacy_mode) {
+			ss->header = capture->rows = tbuf_alloc(fiber->pool);
+			if ([s snapshot_write_header:capture] == NULL)
+				panic("can't capture shard header");
+		}
+	}
+
+	[capture free];
+	frozen = true;
+}
+
+- (void)
+snapshot_thaw
+{
+	if (!frozen)
+		return;
+	free(shard);
+	free(scn);
+	shard = NULL;
+	scn = NULL;
+	shard_count = 0;
+	frozen = false;
+}
+
+- (int)
+snapshot_write_rows:(XLog *)snap shard:(struct snap_shard *)ss
+{
+	return [ss->executor snapshot_write_rows:snap];
+}
+
+/* shards unchanged since previous snapshot are written as snap_ref rows
+   pointing to their rows in older snapshot, see struct snap_ref */
+- (void)
+snapshot_refs_load
+{
+	i64 prev_lsn = [snap_dir greatest_lsn];
+	struct snap_ref *ref;
+	u32 count = 0, reused = 0;
+
+	if (cfg.snap_incremental <= 0 || prev_lsn <= 0 || prev_lsn >= lsn)
+		return;
+	if ((ref = [(SnapDir *)snap_dir load_refs:prev_lsn count:&count]) == NULL)
+		return;
+
+	for (u32 i = 0; i < count; i++) {
+		struct snap_shard *ss = NULL;
+		for (int j = 0; j < shard_count && ss == NULL; j++)
+			if (shard[j].id == ref[i].shard_id)
+				ss = &shard[j];
+
+		if (ss == NULL || ss->scn != ref[i].scn ||
+		    ref[i].depth >= cfg.snap_incremental ||
+		    ![(SnapDir *)snap_dir has_snap:ref[i].lsn part:ref[i].part])
+			continue;
+
+		ss->reuse = true;
+		ss->ref = ref[i];
+		ss->ref.depth++;
+		total_rows -= ss->rows;
+		ss->rows = 0;
+		reused++;
+	}
+	free(ref);
+	say_info("%u of %i shards are unchanged since LSN:%"PRIi64, reused, shard_count, prev_lsn);
+}
+
+/* next snapshot finds rows of shards here */
+- (void)
+snapshot_refs_store
+{
+	struct snap_ref *ref;
+	u32 count = 0;
+
+	if (cfg.snap_incremental <= 0)
+		return;
+
+	ref = xcalloc(shard_count ?: 1, sizeof(*ref));
+	for (int i = 0; i < shard_count; i++)
+		if (shard[i].ref.lsn > 0 && shard[i].ref.offset >= 0)
+			ref[count++] = shard[i].ref;
+	if ([(SnapDir *)snap_dir store_refs:ref count:count lsn:lsn] < 0)
+		say_warn("can't store shard refs, next snapshot will be full");
+	free(ref);
+}
+
+static int
+snapshot_write_initial(XLog *snap, u32 total_rows, u32 flags)
+{
+	struct tbuf *snap_ini = tbuf_alloc(fiber->pool);
+	u8 ver = 0;
+	tbuf_append(snap_ini, &ver, sizeof(ver));
+	tbuf_append(snap_ini, &total_rows, sizeof(total_rows));
+	tbuf_append(snap_ini, &flags, sizeof(flags));
+
+	if ([snap append_row:snap_ini->ptr len:tbuf_len(snap_ini)
+			 scn:-1 tag:snap_initial|TAG_SYS] == NULL)
+	{
+		say_error("unable write initial row");
+		return -1;
+	}
+	return 0;
+}
+
+- (int)
+snapshot_write_shard:(struct snap_shard *)ss to:(XLog *)snap part:(int)part
+{
+	struct tbuf header = *ss->header;
+
+	if (ss->reuse) {
+		struct row_v12 row = { .scn = ss->scn,
+				       .tm = ev_now(),
+				       .tag = snap_ref|TAG_SYS,
+				       .shard_id = ss->id,
+				       .len = sizeof(ss->ref) };
+		if ([snap append_row:&row data:&ss->ref] == NULL)
+			return -1;
+		return 0;
+	}
+
+	if (cfg.snap_incremental > 0)
+		ss->ref = (struct snap_ref){ .lsn = lsn,
+					     .scn = ss->scn,
+					     .offset = [snap append_offset],
+					     .part = part,
+					     .shard_id = ss->id };
+
+	while (tbuf_len(&header) > 0) {
+		struct row_v12 *row = read_bytes(&header, sizeof(*row));
+		read_bytes(&header, row->len);
+		if ([snap append_row:row data:row->data] == NULL) {
+			say_error("unable write initial row");
+			return -1;
+		}
+	}
+
+	if ([self snapshot_write_rows:snap shard:ss] < 0)
+		return -1;
+
+	char dummy[2] = { 0 };
+	struct row_v12 row = { .scn = ss->scn,
+			       .tm = ev_now(),
+			       .tag = shard_final|TAG_SYS,
+			       .shard_id = ss->id,
+			       .len = sizeof(dummy) };
+	if ([snap append_row:&row data:dummy] == NULL)
+		return -1;
+	return 0;
+}
+
+/* writes snap_final and closes file; it's renamed by caller */
+static int
+snapshot_write_final(XLog *snap, i64 snap_scn)
+{
+	const char end[] = "END";
+	if ([snap append_row:end len:strlen(end) scn:snap_scn tag:snap_final|TAG_SYS] == NULL) {
+		say_error("unable write final row");
+		return -1;
+	}
+
+	/* staged rows are counted only once flushed */
+	if ([snap flush] == -1) {
+		say_syserror("snap flush failed");
+		return -1;
+	}
+
+	if ([snap rows] == 0) /* initial snapshot in compat mode has no rows */
+		[snap append_successful:1]; /* -[XLog close] won't rename empty .inprogress, trick it */
+
+	if ([snap write_eof_marker] == -1) {
+		say_syserror("snap close failed");
+		return -1;
+	}
+	return 0;
+}
+
+- (int)
+snapshot_write_part:(struct snap_part *)part
+{
+	if (snapshot_write_initial(part->snap, part->rows, 0) < 0)
+		return -1;
+	for (int i = 0; i < part->shard_count; i++)
+		if ([self snapshot_write_shard:&shard[part->shard[i]] to:part->snap part:part->n] < 0)
+			return -1;
+	return snapshot_write_final(part->snap, -1);
+}
+
+static void *
+snapshot_part_thread(void *arg)
+{
+	struct snap_part *part = arg;
+#ifdef THREADS
+	char name[32];
+	snprintf(name, sizeof(name), "snap_part:%i", part->n);
+	fiber_create_fake(name);
+#endif
+	@try {
+		part->ret = [part->writer snapshot_write_part:part];
+	}
+	@catch (Error *e) {
+		say_error("snapshot part failed: %s", e->reason);
+		part->ret = -1;
+	}
+	@finally {
+		part->eno = errno;
+#ifdef THREADS
+		fiber_destroy_fake();
+#endif
+	}
+	return NULL;
+}
+
+/* parts are written by threads: every executor must allow it */
+- (bool)
+snapshot_concurrent
+{
+	for (int i = 0; i < shard_count; i++) {
+		id executor = shard[i].executor;
+		if (shard[i].reuse)
+			continue;
+		if (![executor respondsTo:@selector(snapshot_write_concurrent)] ||
+		    ![executor snapshot_write_concurrent])
+			return false;
+	}
+	return true;
+}
+
+/* <lsn>.snap tying together parts, which are already written */
+static int
+snapshot_write_manifest(i64 lsn, const i64 *scn, u32 total_rows, int parts)
+{
+	int ret = -1;
+	XLog *snap = [snap_dir open_for_write:lsn scn:scn];
+	if (snap == nil) {
+		say_syserror("can't open snap for writing");
+		return -1;
+	}
+	snap->no_wet = true;
+	if (snapshot_write_initial(snap, total_rows, SNAP_F_PARTS) < 0)
+		goto out;
+	for (int i = 0; i < parts; i++) {
+		u32 n = i;
+		if ([snap append_row:&n len:sizeof(n) scn:-1 tag:snap_part|TAG_SYS] == NULL)
+			goto out;
+	}
+	if (snapshot_write_final(snap, -1) < 0)
+		goto out;
+	if ([snap inprogress_rename] == -1) {
+		say_syserror("snap inprogress rename failed");
+		goto out;
+	}
+	ret = 0;
+out:
+	[snap free];
+	return ret;
+}
+
+/* Shards are spread over `parts' files <lsn>.snap.partNNN by estimated
+   row count and written concurrently. <lsn>.snap becomes a manifest:
+   snap_initial with SNAP_F_PARTS flag followed by snap_part rows.
+   Manifest is renamed last, so incomplete set is never visible. */
+- (int)
+snapshot_write_parts:(int)parts
+{
+	struct snap_part *part = xcalloc(parts, sizeof(*part));
+	int *assign = xcalloc(shard_count, sizeof(*assign));
+	int ret = -1;
+
+	for (int i = 0; i < parts; i++) {
+		part[i].writer = self;
+		part[i].n = i;
+	}
+	/* greedy: every shard goes to the least loaded part */
+	for (int i = 0; i < shard_count; i++) {
+		int min = 0;
+		for (int j = 1; j < parts; j++)
+			if (part[j].rows < part[min].rows ||
+			    (part[j].rows == part[min].rows &&
+			     part[j].shard_count < part[min].shard_count))
+				min = j;
+		assign[i] = min;
+		part[min].rows += shard[i].rows;
+		part[min].shard_count++;
+	}
+	/* shards of each part, in shard order */
+	int *idx = xcalloc(shard_count, sizeof(*idx));
+	for (int j = 0, pos = 0; j < parts; j++) {
+		part[j].shard = idx + pos;
+		for (int i = 0; i < shard_count; i++)
+			if (assign[i] == j)
+				idx[pos++] = i;
+	}
+
+	for (int i = 0; i < parts; i++) {
+		part[i].snap = [snap_dir open_for_write:lsn scn:scn part:i];
+		if (part[i].snap == nil) {
+			say_syserror("can't open snap part for writing");
+			goto out;
+		}
+		part[i].snap->no_wet = true;
+	}
+
+	say_info("saving snapshot LSN:%"PRIi64" in %i parts", lsn, parts);
+#ifdef THREADS
+	pthread_t *thread = xcalloc(parts, sizeof(*thread));
+	for (int i = 0; i < parts; i++)
+		if ((errno = pthread_create(&thread[i], NULL, snapshot_part_thread, &part[i])) != 0)
+			panic_syserror("pthread_create");
+	for (int i = 0; i < parts; i++)
+		pthread_join(thread[i], NULL);
+	free(thread);
+#else
+	for (int i = 0; i < parts; i++)
+		snapshot_part_thread(&part[i]);
+#endif
+
+	for (int i = 0; i < parts; i++) {
+		if (part[i].ret != 0) {
+			errno = part[i].eno;
+			say_error("snapshot part %i failed", i);
+			goto out;
+		}
+	}
+	for (int i = 0; i < parts; i++) {
+		if ([part[i].snap inprogress_rename] == -1) {
+			say_syserror("snap part inprogress rename failed");
+			goto out;
+		}
+	}
+
+	if (snapshot_write_manifest(lsn, scn, total_rows, parts) < 0)
+		goto out;
+	[self snapshot_refs_store];
+	say_info("done");
+	ret = 0;
+out:
+	for (int i = 0; i < parts; i++)
+		[part[i].snap free];
+	free(idx);
+	free(assign);
+	free(part);
+	return ret;
+}
+
+/* offline fold by several processes, see -[Recovery fold_jobs:]. Each one
+   writes part `n' with all shards it has, parent adds the manifest */
+- (int)
+snapshot_write_fold_part:(int)n lsn:(i64)fold_lsn
+{
+	int ret = -1;
+	[self snapshot_freeze];
+	lsn = fold_lsn;
+
+	int *idx = xcalloc(shard_count + 1, sizeof(*idx));
+	for (int i = 0; i < shard_count; i++)
+		idx[i] = i;
+	struct snap_part part = { .writer = self, .n = n, .rows = total_rows,
+				  .shard = idx, .shard_count = shard_count };
+
+	part.snap = [snap_dir open_for_write:lsn scn:scn part:n];
+	if (part.snap == nil) {
+		say_syserror("can't open snap part for writing");
+		goto out;
+	}
+	part.snap->no_wet = true;
+
+	say_info("saving snapshot part %i LSN:%"PRIi64, n, lsn);
+	if ([self snapshot_write_part:&part] < 0)
+		goto out;
+	if ([part.snap inprogress_rename] == -1) {
+		say_syserror("snap part inprogress rename failed");
+		goto out;
+	}
+	ret = 0;
+out:
+	[part.snap free];
+	free(idx);
+	[self snapshot_thaw];
+	return ret;
+}
+
+- (int)
+snapshot_write_manifest:(int)parts lsn:(i64)lsn_
+{
+	i64 *map = xcalloc(MAX_SHARD, sizeof(*map));
+	u32 rows = 0;
+	int ret = -1;
+
+	for (int i = 0; i < parts; i++) {
+		if ([snap_dir scn_map:map lsn:lsn_ part:i] < 0)
+			goto out;
+
+		XLog *part = [snap_dir open_for_read:lsn_ part:i];
+		if (part == nil) {
+			say_syserror("can't open snap part %i", i);
+			goto out;
+		}
+		struct row_v12 *row = [part fetch_row];
+		if (row && (row->tag & TAG_MASK) == snap_initial &&
+		    row->len >= sizeof(u8) + sizeof(u32) * 2)
+		{
+			struct tbuf data = TBUF(row->data, row->len, NULL);
+			(void)read_u8(&data);
+			rows += read_u32(&data);
+		}
+		[part free];
+	}
+	ret = snapshot_write_manifest(lsn_, map, rows, parts);
+out:
+	free(map);
+	return ret;
+}
 
 - (int)
 snapshot_write
 {
+	if (!frozen) {
+		[self snapshot_freeze];
+		@try {
+			return [self snapshot_write];
+		}
+		@finally {
+			[self snapshot_thaw];
+		}
+	}
+
         XLog *snap;
-	i64 *scn;
-	u32 total_rows = 0;
-	bool legacy_mode = 0;
 
-	say_debug("%s: LSN:%"PRIi64, __func__, [state lsn]);
+	say_debug("%s: LSN:%"PRIi64, __func__, lsn);
 
-	if ([state lsn] < 0)
+	if (lsn < 0)
 		return -1;
 
-	scn = xcalloc(MAX_SHARD, sizeof(*scn));
-	for (int i = 0; i < MAX_SHARD; i++) {
-		Shard<Shard> *shard = [state shard:i];
-		if (shard == nil)
-			continue;
-		if (i == 0 && shard->dummy)
-			legacy_mode = 1;
+	if (!legacy_mode)
+		[self snapshot_refs_load];
 
-		scn[i] = [shard scn];
-		total_rows += [[shard executor] snapshot_estimate];
+	if (!legacy_mode && cfg.snap_parts > 1 && shard_count > 1) {
+		if ([self snapshot_concurrent])
+			return [self snapshot_write_parts:MIN(cfg.snap_parts, shard_count)];
+		say_warn("some executors can't write snapshot concurrently, ignoring snap_parts");
 	}
 
-	snap = [snap_dir open_for_write:[state lsn] scn:scn];
+	snap = [snap_dir open_for_write:lsn scn:scn];
 	if (snap == nil) {
 		say_syserror("can't open snap for writing");
 		return -1;
@@ -749,16 +1912,16 @@ snapshot_write
 		struct tbuf *snap_ini = tbuf_alloc(fiber->pool);
 		tbuf_append(snap_ini, &total_rows, sizeof(total_rows));
 
-		u32 run_crc_log = [[state shard:0] run_crc_log];
+		u32 run_crc_log = legacy_run_crc;
 		tbuf_append(snap_ini, &run_crc_log, sizeof(run_crc_log));
 		u32 run_crc_mod = 0;
 		tbuf_append(snap_ini, &run_crc_mod, sizeof(run_crc_mod));
 
-		if ([state lsn] == 1) {
+		if (lsn == 1) {
 			snap_scn = 1;
 		} else {
-			assert([state shard:0]);
-			snap_scn = [[state shard:0] scn];
+			assert(shard_count > 0 && shard[0].id == 0);
+			snap_scn = shard[0].scn;
 		}
 
 		if ([snap append_row:snap_ini->ptr len:tbuf_len(snap_ini)
@@ -767,62 +1930,19 @@ snapshot_write
 			say_error("unable write initial row");
 			return -1;
 		}
-		if ([[[state shard:0] executor] snapshot_write_rows:snap] < 0)
+		if ([self snapshot_write_rows:snap shard:&shard[0]] < 0)
 			return -1;
 	} else {
-		struct tbuf *snap_ini = tbuf_alloc(fiber->pool);
-		u8 ver = 0;
-		tbuf_append(snap_ini, &ver, sizeof(ver));
-		tbuf_append(snap_ini, &total_rows, sizeof(total_rows));
-		u32 flags = 0;
-		tbuf_append(snap_ini, &flags, sizeof(flags));
-
-		if ([snap append_row:snap_ini->ptr len:tbuf_len(snap_ini)
-				 scn:snap_scn tag:snap_initial|TAG_SYS] == NULL)
-		{
-			say_error("unable write initial row");
+		if (snapshot_write_initial(snap, total_rows, 0) < 0)
 			return -1;
-		}
 
-		for (int i = 0; i < MAX_SHARD; i++) {
-			Shard<Shard> *shard = [state shard:i];
-			if (shard == nil)
-				continue;
-
-			if ([shard snapshot_write_header:snap] == NULL)
-			{
-				say_error("unable write initial row");
+		for (int i = 0; i < shard_count; i++)
+			if ([self snapshot_write_shard:&shard[i] to:snap part:-1] < 0)
 				return -1;
-			}
-
-			if ([[shard executor] snapshot_write_rows:snap] < 0)
-				return -1;
-
-			char dummy[2] = { 0 };
-			if ([snap append_row:dummy len:sizeof(dummy)
-				       shard:shard tag:shard_final|TAG_SYS] == NULL)
-				return -1;
-		}
-	}
-
-	const char end[] = "END";
-	if ([snap append_row:end len:strlen(end) scn:snap_scn tag:snap_final|TAG_SYS] == NULL) {
-		say_error("unable write final row");
-		return -1;
 	}
 
-	if ([snap rows] == 0) /* initial snapshot in compat mode has no rows */
-		[snap append_successful:1]; /* -[XLog close] won't rename empty .inprogress, trick it */
-
-	if ([snap flush] == -1) {
-		say_syserror("snap flush failed");
+	if (snapshot_write_final(snap, snap_scn) < 0)
 		return -1;
-	}
-
-	if ([snap write_eof_marker] == -1) {
-		say_syserror("snap close failed");
-		return -1;
-	}
 
 	if ([snap inprogress_rename] == -1) {
 		say_syserror("snap inprogress rename failed");
@@ -830,6 +1950,8 @@ snapshot_write
 	}
 
 	[snap free];
+	if (!legacy_mode)
+		[self snapshot_refs_store];
 	say_info("done");
 	return 0;
 }
@@ -85,6 +85,8 @@ struct octopus_cfg cfg;
 
 Recovery *recovery;
 XLogDir *wal_dir = nil, *snap_dir = nil;
+XLogDir *wal_stream_dir[WAL_STREAM_MAX];
+int wal_streams = 1;
 static ev_timer coredump_timer = { .coro = 0 };
 #if OCT_CHILDREN
 int keepalive_pipe[2] = {-1, -1};
@@ -541,6 +543,25 @@ octopus_ev_invoke_pending()
 		say_warn("too long loop %.3f sec", d);
 }
 
+#if CFG_snap_dir
+static bool
+replication_configured(void)
+{
+	if (module("feeder") != NULL)
+		return true;
+#if CFG_wal_feeder_addr
+	if (cfg.wal_feeder_addr != NULL)
+		return true;
+#endif
+#if CFG_peer
+	for (struct octopus_cfg_peer **p = cfg.peer; p && *p; p++)
+		if (!cfg.hostname || strcmp((*p)->name, cfg.hostname) != 0)
+			return true;
+#endif
+	return false;
+}
+#endif
+
 char **octopus_argv;
 static int
 octopus(int argc, char **argv)
@@ -578,6 +599,10 @@ octopus(int argc, char **argv)
 				       "=FILE|SCN", "cat xlog to stdout in readable format and exit"),
 			   gopt_option('F', GOPT_ARG, gopt_shorts(0), gopt_longs("fold"),
 				       "=SCN", "calculate CRC32C of storage at given SCN and exit"),
+			   gopt_option('I', GOPT_ARG, gopt_shorts(0), gopt_longs("index-xlog"),
+				       "=FILE", "rebuild seek index of xlog and exit"),
+			   gopt_option('B', GOPT_ARG, gopt_shorts(0), gopt_longs("bench-recovery"),
+				       "=SPEC", "generate synthetic snapshot and xlogs, time their loading and exit"),
 			   gopt_option('i', 0, gopt_shorts('i'),
 				       gopt_longs("init-storage"),
 				       NULL, "initialize storage (an empty snapshot file) and exit"),
@@ -663,6 +688,31 @@ octopus(int argc, char **argv)
 		}
 		panic("no --cat action defined");
 	}
+
+	if (gopt_arg(opt, 'I', &cat_filename)) {
+		salloc_init(0, 0, 0);
+		fiber_init(NULL);
+		set_proc_title("index %s", cat_filename);
+		gopt_arg(opt, 'c', &cfg_filename);
+		fill_default_octopus_cfg(&cfg);
+		if (access(cfg_filename, R_OK) == 0 && load_cfg(&cfg, 0) != 0)
+			panic("can't load config: %s", cfg_err);
+
+		return xlog_index_rebuild(cat_filename) < 0 ? EX_DATAERR : 0;
+	}
+
+	if (gopt_arg(opt, 'B', &cat_filename)) {
+		gopt_arg(opt, 'c', &cfg_filename);
+		fill_default_octopus_cfg(&cfg);
+		if (access(cfg_filename, R_OK) == 0 && load_cfg(&cfg, 0) != 0)
+			panic("can't load config: %s", cfg_err);
+		salloc_init(0, cfg.slab_alloc_minimal, cfg.slab_alloc_factor);
+		octopus_ev_init();
+		fiber_init(NULL);
+		set_proc_title("bench %s", cat_filename);
+
+		return recovery_bench(cat_filename) < 0 ? EX_DATAERR : 0;
+	}
 #endif
 
 #if OCT_RECOVERY
@@ -806,6 +856,23 @@ init_storage:
 #endif
 	snap_dir = [[SnapDir alloc] init_dirname:strdup(cfg.snap_dir)];
 	wal_dir = [[WALDir alloc] init_dirname:strdup(cfg.wal_dir)];
+	wal_stream_dir[0] = wal_dir;
+	for (struct octopus_cfg_wal_stream **s = cfg.wal_stream; s && *s; s++) {
+		if (wal_streams == WAL_STREAM_MAX)
+			panic("too many wal_stream, max %i", WAL_STREAM_MAX - 1);
+		wal_stream_dir[wal_streams++] = [[WALDir alloc] init_dirname:strdup((*s)->dir)];
+	}
+	if (replication_configured()) {
+		/* feeder serves wal_dir and snapshot files as they are:
+		   replicas would miss rows of shards written to other
+		   streams, to snapshot parts or behind snap_ref rows */
+		if (wal_streams > 1)
+			panic("wal_stream can't be used with feeder or replication");
+		if (cfg.snap_parts > 1 || cfg.fold_jobs > 1)
+			panic("snap_parts and fold_jobs can't be used with feeder or replication");
+		if (cfg.snap_incremental > 0)
+			panic("snap_incremental can't be used with feeder or replication");
+	}
 
 	if (gopt(opt, 'i')) {
 		init_storage = true;
@@ -880,7 +947,9 @@ init_storage:
 	} else if (CFG_SLAB_SIZE > 32*1024*1024) {
 		panic("slab_alloc_slab_power too big");
 	}
+	salloc_huge_pages = cfg.slab_alloc_huge_pages;
 	salloc_init(fixed_arena, cfg.slab_alloc_minimal, cfg.slab_alloc_factor);
+	index_sort_threads = cfg.index_sort_threads;
 
 	stat_init();
 #ifdef CFG_graphite_addr
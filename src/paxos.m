@@ -1018,7 +1018,7 @@ loop:
 
 		struct proposal *pack_first = p;
 		struct wal_pack pack;
-		wal_pack_prepare(recovery->writer, &pack);
+		wal_pack_prepare([recovery shard_writer:paxos->id], &pack);
 		do {
 			assert(p->ballot == ULLONG_MAX);
 			assert(p->flags & P_APPLIED);
@@ -1035,7 +1035,7 @@ loop:
 			p = RB_NEXT(ptree, &r->proposals, p);
 		} while (p && p->scn <= paxos->scn);
 
-		struct wal_reply *reply = [recovery->writer wal_pack_submit];
+		struct wal_reply *reply = [[recovery shard_writer:paxos->id] wal_pack_submit];
 		if (reply->row_count) {
 			p = pack_first;
 			for (int i = 0; i < reply->row_count; i++) {
@@ -1232,6 +1232,15 @@ submit:(const void *)data len:(u32)len tag:(u16)tag
 
 }
 
+- (int)
+submit:(const void *)data len:(u32)len tag:(u16)tag durability:(enum wal_durability)durability
+{
+	/* paxos replies only after quorum of accepts,
+	   i.e. every write is WAL_DURABILITY_REPLICATED */
+	(void)durability;
+	return [self submit:data len:len tag:tag];
+}
+
 - (int)
 write_scn:(i64)scn_ data:(const void *)data len:(u32)len tag:(u16)tag
 {
@@ -1239,10 +1248,13 @@ write_scn:(i64)scn_ data:(const void *)data len:(u32)len tag:(u16)tag
 			       .tag = tag };
 	row.shard_id = self->id;
 	struct wal_pack pack;
-	wal_pack_prepare(recovery->writer, &pack);
+	wal_pack_prepare([recovery shard_writer:self->id], &pack);
+	/* acceptor answers leader right after this: promise or accept
+	   must not be lost by crash once it's answered */
+	wal_pack_set_durability(&pack, WAL_DURABILITY_SYNC);
 	wal_pack_append_row(&pack, &row);
 	wal_pack_append_data(&pack, data, len);
-	struct wal_reply *reply = [recovery->writer wal_pack_submit];
+	struct wal_reply *reply = [[recovery shard_writer:self->id] wal_pack_submit];
 
 	if (reply->row_count) {
 		run_crc_scn = reply->scn;
@@ -1349,7 +1361,7 @@ recover_row:(struct row_v12 *)r
 {
 	// calculate run_crc _before_ calling executor: executor may change row
 	if (scn_changer(r->tag))
-		run_crc_calc(&run_crc_log, r->tag, r->data, r->len);
+		run_crc_calc(&run_crc_log, r);
 
 	if ((r->tag & ~TAG_MASK) != TAG_SYS) {
 		[executor apply:&TBUF(r->data, r->len, fiber->pool) tag:r->tag];
@@ -44,6 +44,7 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 
 uint32_t crc32_table[] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -871,6 +872,33 @@ static inline uint32_t hardware_crc32c(uint32_t crc, const unsigned char *buf, u
 
 	return crc;
 }
+
+/* crc32 instruction has latency 3 and throughput 1: three independent
+   buffers are hashed in lockstep to keep it busy. Helps short buffers
+   most, pcl kernels above do the same within a single buffer >= 256 bytes. */
+static inline void
+hardware_crc32c_x3(uint32_t *crc, const unsigned char *const *buf, const unsigned int *len)
+{
+	const unsigned char *b0 = buf[0], *b1 = buf[1], *b2 = buf[2];
+	uint64_t c0 = crc[0], c1 = crc[1], c2 = crc[2];
+	unsigned int i, n = len[0];
+
+	if (n > len[1])
+		n = len[1];
+	if (n > len[2])
+		n = len[2];
+	n &= ~7u;
+
+	for (i = 0; i < n; i += 8) {
+		mm_crc32_u64(c0, *(const uint64_t *)(b0 + i));
+		mm_crc32_u64(c1, *(const uint64_t *)(b1 + i));
+		mm_crc32_u64(c2, *(const uint64_t *)(b2 + i));
+	}
+
+	crc[0] = hardware_crc32c(c0, b0 + n, len[0] - n);
+	crc[1] = hardware_crc32c(c1, b1 + n, len[1] - n);
+	crc[2] = hardware_crc32c(c2, b2 + n, len[2] - n);
+}
 #undef CPUID_FEATURE
 #undef mm_crc32_u8
 #undef mm_crc32_u16
@@ -895,15 +923,30 @@ crc32c(uint32_t crc32c,
 	}
 }
 
+void
+crc32c_multi(uint32_t *crc, const unsigned char *const *buf, const unsigned int *len, int n)
+{
+	int i = 0;
+#if defined(SSE42_CRC_FEATURE_BIT)
+	if (cached_cpu_supports_crc32) {
+		for (; i + 3 <= n; i += 3)
+			hardware_crc32c_x3(crc + i, buf + i, len + i);
+	}
+#endif
+	for (; i < n; i++)
+		crc[i] = crc32c(crc[i], buf[i], len[i]);
+}
+
 static uint32_t crc32c_pow2k[48][32] = {};
 
 static inline uint32_t
 crc32_mult(uint32_t *pow2k, uint32_t ocrc)
 {
-	int i;
 	uint32_t crc = 0;
-	for (i = 0; i < 32; i++) {
-		crc ^= !!(ocrc & (1 << i)) * pow2k[i];
+	/* visit set bits only: combine is called per row by run_crc */
+	while (ocrc) {
+		crc ^= pow2k[__builtin_ctz(ocrc)];
+		ocrc &= ocrc - 1;
 	}
 	return crc;
 }
@@ -920,24 +963,22 @@ static void
 crc32c_fill_tables()
 {
 	int n;
-	if (crc32c_pow2k[47][31] == 0) {
-		crc32c_pow2k[0][0] = 0x82f63b78;
-		for (n = 1; n < 32; n++) {
-			crc32c_pow2k[0][n] = 1 << (n-1);
-		}
-		for (n = 1; n < 48; n++) {
-			crc32_square(crc32c_pow2k[n], crc32c_pow2k[n-1]);
-		}
+	crc32c_pow2k[0][0] = 0x82f63b78;
+	for (n = 1; n < 32; n++) {
+		crc32c_pow2k[0][n] = 1 << (n-1);
+	}
+	for (n = 1; n < 48; n++) {
+		crc32_square(crc32c_pow2k[n], crc32c_pow2k[n-1]);
 	}
 }
 
 uint32_t
 crc32c_combine(uint32_t crc1, uint32_t crc2, unsigned int len2)
 {
+	/* called from snapshot writer threads too */
+	static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
 	int n = 3, tz;
-	if (crc32c_pow2k[47][31] == 0) {
-		crc32c_fill_tables();
-	}
+	pthread_once(&tables_once, crc32c_fill_tables);
 	while (len2) {
 		while (len2 & 1) {
 			crc1 = crc32_mult(crc32c_pow2k[n], crc1);
@@ -6,5 +6,8 @@
 uint32_t crc32(const void *buf, size_t size);
 uint32_t crc32c(uint32_t crc32c, const unsigned char *buffer, unsigned int length);
 uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, unsigned int length2);
+/* crc[i] = crc32c(crc[i], buf[i], len[i]) for i < n, independent buffers
+   are processed in parallel */
+void crc32c_multi(uint32_t *crc, const unsigned char *const *buf, const unsigned int *len, int n);
 
 #endif
@@ -0,0 +1,64 @@
+/*
+ * crc32c microbenchmark: single buffer crc32c() vs crc32c_multi()
+ * on row sized buffers. Build with `make crc32c_bench`.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.h"
+
+#define BATCH 16
+#define TOTAL (256 << 20)
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(void)
+{
+	static const unsigned int sizes[] = { 64, 256, 1024, 2048, 4096, 16384 };
+	unsigned char *mem = malloc(BATCH * 16384 + 64);
+	const unsigned char *buf[BATCH];
+	unsigned int len[BATCH];
+	uint32_t crc[BATCH], sink = 0;
+	size_t i, j, k;
+
+	for (i = 0; i < BATCH * 16384 + 64; i++)
+		mem[i] = rand();
+
+	printf("%8s %12s %12s\n", "size", "single MB/s", "multi MB/s");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size_t iter = TOTAL / (sizes[i] * BATCH);
+		for (j = 0; j < BATCH; j++) {
+			/* rows are not aligned in xlog: 4 byte marker precedes them */
+			buf[j] = mem + j * sizes[i] + 4;
+			len[j] = sizes[i];
+		}
+
+		double t0 = now();
+		for (k = 0; k < iter; k++)
+			for (j = 0; j < BATCH; j++)
+				sink ^= crc32c(0, buf[j], len[j]);
+		double t1 = now();
+		for (k = 0; k < iter; k++) {
+			for (j = 0; j < BATCH; j++)
+				crc[j] = 0;
+			crc32c_multi(crc, buf, len, BATCH);
+			sink ^= crc[0];
+		}
+		double t2 = now();
+
+		printf("%8u %12.0f %12.0f\n", sizes[i],
+		       TOTAL / (t1 - t0) / (1 << 20), TOTAL / (t2 - t1) / (1 << 20));
+	}
+	free(mem);
+	return sink == 0xdeadbeef;
+}
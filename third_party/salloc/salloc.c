@@ -133,6 +133,7 @@ struct slab {
 	void *brk;
 #if HAVE_MADVISE
 	bool need_madvise;
+	bool hugetlb; /* part of hugetlb page can't be released */
 #endif
 	SLIST_ENTRY(slab) link;
 	SLIST_ENTRY(slab) free_link;
@@ -150,9 +151,17 @@ struct arena {
 	size_t used;
 	size_t item_used;
 	int    free_slabs_cnt;
+	bool   hugetlb; /* the last mapping, slabs are carved from it */
 	struct slab_slist_head slabs, free_slabs;
 };
 
+/* 0: regular pages
+   1: transparent huge pages, madvise(MADV_HUGEPAGE)
+   2: hugetlb pages, mmap(MAP_HUGETLB). falls back to 1 if there are none */
+int salloc_huge_pages;
+static bool hugetlb_failed;
+#define HUGETLB_PAGE_SIZE (2 << 20)
+
 static uint32_t slab_active_caches;
 static struct slab_cache slab_caches[256];
 static struct arena arena[2], *fixed_arena = &arena[0], *grow_arena = &arena[1];
@@ -224,10 +233,25 @@ slab_cache_series_init(enum arena_type arena_type, size_t minimal, double factor
 }
 
 static void *
-mmapa(size_t size, size_t align)
+mmapa(size_t size, size_t align, bool *hugetlb)
 {
 	void *ptr, *aptr;
 	assert (size % align == 0);
+	*hugetlb = false;
+
+#ifdef MAP_HUGETLB
+	/* padding is unmapped later: it must consist of whole huge pages */
+	if (salloc_huge_pages == 2 && !hugetlb_failed && align % HUGETLB_PAGE_SIZE == 0) {
+		ptr = mmap(MMAP_HINT_ADDR, size + align, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED) {
+			*hugetlb = true;
+			goto align;
+		}
+		say_syserror("mmap(MAP_HUGETLB), falling back to transparent huge pages");
+		hugetlb_failed = true;
+	}
+#endif
 
 	ptr = mmap(MMAP_HINT_ADDR, size + align, /* add padding for later rounding */
 		   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -235,6 +259,14 @@ mmapa(size_t size, size_t align)
 		say_syserror("mmap");
 		return NULL;
 	}
+#if HAVE_MADVISE && defined(MADV_HUGEPAGE)
+	if (salloc_huge_pages > 0 && madvise(ptr, size + align, MADV_HUGEPAGE) < 0)
+		say_syserror("madvise(MADV_HUGEPAGE)");
+#endif
+
+#ifdef MAP_HUGETLB
+align:
+#endif
 
 	aptr = (void *)(((uintptr_t)(ptr) & ~(align - 1)) + align);
 	size_t pad_begin = aptr - ptr,
@@ -249,10 +281,12 @@ mmapa(size_t size, size_t align)
 static bool
 arena_add_mmap(struct arena *arena, size_t size)
 {
-	void *ptr = mmapa(size, SLAB_SIZE);
+	bool hugetlb;
+	void *ptr = mmapa(size, SLAB_SIZE, &hugetlb);
 	if (!ptr)
 		return false;
 
+	arena->hugetlb = hugetlb;
 	arena->size += size;
 	arena->brk = arena->base = ptr;
 	return true;
@@ -322,8 +356,10 @@ salloc_init(size_t size, size_t minimal, double factor)
 	slab_cache_series_init(size > 0 ? SLAB_FIXED : SLAB_GROW,
 			       MAX(sizeof(void *), minimal), factor);
 	if (size > 0)
-		say_info("slab allocator configured, fixed_arena:%.1fGB",
-			 size / (1024. * 1024 * 1024));
+		say_info("slab allocator configured, fixed_arena:%.1fGB%s",
+			 size / (1024. * 1024 * 1024),
+			 fixed_arena->hugetlb ? " hugetlb" :
+			 salloc_huge_pages > 0 ? " THP" : "");
 }
 
 void
@@ -423,6 +459,9 @@ slab_of(struct slab_cache *cache)
 	}
 
 	if ((slab = arena_alloc(cache->arena)) != NULL) {
+#if HAVE_MADVISE
+		slab->hugetlb = cache->arena->hugetlb;
+#endif
 		SLIST_INSERT_HEAD(&cache->arena->slabs, slab, link);
 		cache->arena->item_used += sizeof(struct slab);
 		format_slab(cache, slab);
@@ -530,12 +569,21 @@ sfree(void *ptr)
 		cache->arena->free_slabs_cnt++;
 
 #if HAVE_MADVISE
-		if (slab->need_madvise) {
+		if (slab->need_madvise && !slab->hugetlb) {
 			slab->need_madvise = false;
-			int r;
-			r = madvise((void *)slab + page_size, SLAB_SIZE - page_size, MADV_DONTNEED);
-			(void)r;
-			assert(r == 0);
+			/* with THP releasing part of huge page splits it:
+			   release whole huge pages only, unless slab is smaller
+			   than huge page and wouldn't be released at all */
+			size_t granule = salloc_huge_pages > 0 && SLAB_SIZE >= HUGETLB_PAGE_SIZE ?
+					 HUGETLB_PAGE_SIZE : page_size;
+			void *start = (void *)TYPEALIGN(granule, (uintptr_t)slab + page_size),
+			     *end = (void *)slab + SLAB_SIZE;
+			if (start < end) {
+				int r;
+				r = madvise(start, end - start, MADV_DONTNEED);
+				(void)r;
+				assert(r == 0);
+			}
 		}
 #endif
 	}
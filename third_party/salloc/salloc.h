@@ -64,6 +64,7 @@ enum salloc_error {
 };
 
 extern int salloc_error;
+extern int salloc_huge_pages;
 
 void salloc_init(size_t size, size_t minimal, double factor);
 void salloc_destroy(void);